@@ -14,6 +14,13 @@ void vecD_print_n(double *vec, size_t i0, size_t n, char *end)
 void kdtrd_print(KDTrD *kdt, ssize_t root, size_t spaces)
 {
     if(root < 0) return;
+    if(kdt->buckets[root].leaf) {
+        for(size_t i = root; i < root + kdt->buckets[root].leaf; i++) {
+            printf("%*s%zu ", (int)spaces, "", kdt->buckets[i].index);
+            vecD_print_n(kdt->ref, kdt->buckets[i].index, kdt->dim, "\n");
+        }
+        return;
+    }
     printf("%*s%zu ", (int)spaces, "", kdt->buckets[root].index);
     vecD_print_n(kdt->ref, kdt->buckets[root].index, kdt->dim, "\n");
     kdtrd_print(kdt, kdt->buckets[root].left, spaces + 1);
@@ -20,7 +20,6 @@ void ransac(void)
     size_t n = 100000;
     size_t n_outlier = 10000;
     size_t n_searches = 50;
-    size_t max_search_per = 100; /* decrease to potentially be faster, but not hit all points in return */
 
     double y_min = 2000;
     double y_max = 5000;
@@ -100,9 +99,9 @@ void ransac(void)
         while(!(y < y_min) && !(y > y_max) && !(x < x_min) && !(x > x_max)) {
             pt[0] = x;
             pt[1] = y;
-            ssize_t found = kdtrd_range(&tree, pt, dist*dist, true, 0, max_search_per);
+            ssize_t found = kdtrd_range_each(&tree, pt, dist*dist, true, 0, 0);
             //printf("[%.1f, %.1f], found %zi\n", x, y, found);
-            total += found < 0 ? max_search_per : found;
+            total += found;
             x += step * cos(angle);
             y += step * sin(angle);
         }
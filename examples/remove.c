@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "../src/kdtree.h"
+KDTREE_INCLUDE(KdD, kdd, double);
+KDTREE_IMPLEMENT(KdD, kdd, double);
+
+/* regression checks for queries on trees with removed points; exits nonzero
+ * on the first mismatch against brute force */
+
+#define CHECK(x)    if(!(x)) { printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #x); return 1; }
+
+static double brute(double *arr, bool *removed, size_t n, size_t dim, double *pt) {
+    double best = INFINITY;
+    for(size_t i = 0; i < n; i++) {
+        if(removed[i]) continue;
+        double d = 0;
+        for(size_t j = 0; j < dim; j++) d += (arr[i * dim + j] - pt[j]) * (arr[i * dim + j] - pt[j]);
+        if(d < best) best = d;
+    }
+    return best;
+}
+
+int main(void)
+{
+    size_t dim = 2;
+
+    /* removing the root, then querying its coordinates finds its neighbour */ {
+    double arr[] = { 0,0, 1,0, 2,0, 3,0, 4,0 };
+    KdD tree = {0};
+    CHECK(!kdd_create(&tree, arr, 10, dim, 0, 0));
+    size_t root = tree.buckets[tree.root].index;
+    CHECK(!kdd_remove(&tree, root));
+    /* out of range indices are an error, not a read past ref */
+    CHECK(kdd_remove(&tree, 9) == -1);
+    CHECK(kdd_remove(&tree, (size_t)-1) == -1);
+    double d;
+    ssize_t found = kdd_nearest(&tree, &arr[root], &d, false);
+    CHECK(found >= 0 && d == 1);
+    /* a marked point at the query location doesn't hide the rest either */
+    CHECK(kdd_nearest(&tree, &arr[found], &d, true) == found && d == 0);
+    CHECK(kdd_nearest(&tree, &arr[found], &d, true) >= 0 && d == 1);
+    kdd_free(&tree);
+    }
+
+    /* caller-owned mark sets from before an insert get rejected */ {
+    double arr[] = { 0,0, 1,0, 2,0, 3,0, 4,0, 5,0 };
+    KdD tree = {0};
+    KDTreeVisit visit = {0};
+    CHECK(!kdd_create(&tree, arr, 10, dim, 0, 0));
+    CHECK(!kdd_visit_create(&tree, &visit));
+    CHECK(!kdd_insert(&tree, arr, 12, 10));
+    double d;
+    size_t pts[6];
+    CHECK(kdd_nearest_visit(&tree, &visit, &arr[10], &d) == -1);
+    CHECK(kdd_range_visit(&tree, &visit, &arr[10], 4, pts, 6) == -1);
+    kdtree_visit_free(&visit);
+    CHECK(!kdd_visit_create(&tree, &visit));
+    CHECK(kdd_nearest_visit(&tree, &visit, &arr[10], &d) == 10 && d == 0);
+    kdtree_visit_free(&visit);
+    kdd_free(&tree);
+    }
+
+    /* so do they after removes shrank the tree into fewer buckets */ {
+    double arr[] = { 0,0, 1,0, 2,0, 3,0, 4,0, 5,0, 6,0, 7,0, 8,0, 9,0 };
+    KdD tree = {0};
+    KDTreeVisit visit = {0};
+    CHECK(!kdd_create(&tree, arr, 20, dim, 0, 0));
+    CHECK(!kdd_visit_create(&tree, &visit));
+    for(size_t i = 0; i < 6; i++) CHECK(!kdd_remove(&tree, i * dim));
+    CHECK(tree.n_buckets < visit.len);
+    double d;
+    CHECK(kdd_nearest_visit(&tree, &visit, &arr[0], &d) == -1);
+    kdtree_visit_free(&visit);
+    CHECK(!kdd_visit_create(&tree, &visit));
+    CHECK(kdd_nearest_visit(&tree, &visit, &arr[0], &d) == 12 && d == 36);
+    CHECK(kdd_nearest_visit(&tree, &visit, &arr[0], &d) == 14 && d == 49);
+    kdtree_visit_free(&visit);
+    kdd_free(&tree);
+    }
+
+    /* random inserts and removes, queried on stored points */ {
+    size_t n = 4000;
+    double *arr = malloc(sizeof(*arr) * n * dim);
+    bool *removed = calloc(n, sizeof(*removed));
+    bool *fresh = calloc(n, sizeof(*fresh));
+    for(size_t i = 0; i < n * dim; i++) arr[i] = rand() % 64;
+    KdD tree = {0};
+    tree.leaf_size = 4;
+    CHECK(!kdd_create(&tree, arr, n / 2 * dim, dim, 0, 0));
+    for(size_t i = n / 2; i < n; i++) removed[i] = fresh[i] = true;
+    for(size_t k = 0; k < 20000; k++) {
+        size_t i = rand() % n;
+        if(fresh[i] && !(k % 3)) {
+            CHECK(!kdd_insert(&tree, arr, n * dim, i * dim));
+            removed[i] = fresh[i] = false;
+        } else if(!removed[i] && k % 3 == 1) {
+            CHECK(!kdd_remove(&tree, i * dim));
+            removed[i] = true;
+        }
+        double *pt = &arr[(rand() % n) * dim];
+        double d;
+        ssize_t found = kdd_nearest(&tree, pt, &d, false);
+        double best = brute(arr, removed, n, dim, pt);
+        CHECK(found >= 0 && !removed[found / dim] && d == best);
+        ssize_t idx;
+        CHECK(kdd_nearest_batch(&tree, pt, 1, dim, &idx, &d) == 0 && d == best);
+    }
+    kdd_free(&tree);
+    free(arr);
+    free(removed);
+    free(fresh);
+    }
+
+    printf("ok\n");
+    return 0;
+}
@@ -26,61 +26,716 @@ SOFTWARE. */
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <math.h> /* INFINITY */
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__AVX2__) || defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 //#include "vec.h"
-#include <rlc/array.h>
 #include <rlc/err.h>
 
 #define KDTREE_SWAP(x,y)   {ssize_t t = x; x = y; y = t; }
 #define KDTREE_DEBUG    1
 
+/* insertions deeper than log(n) / log(1 / KDTREE_ALPHA) rebuild the first
+ * subtree whose larger child holds more than KDTREE_ALPHA of its points */
+#ifndef KDTREE_ALPHA
+#define KDTREE_ALPHA    0.7
+#endif
+
+/* subranges at least this large get built on their own thread in A##_create_mt */
+#ifndef KDTREE_PARALLEL_MIN
+#define KDTREE_PARALLEL_MIN     65536
+#endif
+
+/* KDTREE_SPLIT_RANDOM picks among this many highest variance dimensions */
+#ifndef KDTREE_RANDOM_DIMS
+#define KDTREE_RANDOM_DIMS      5
+#endif
+
 typedef struct KDTreeNode {
     ssize_t left;
     ssize_t right;
     size_t index;
-    bool mark;
+    uint32_t leaf; /* >0: leaf holding the points of buckets[this .. this+leaf) */
+    bool dead;     /* removed, but still splits its subtree */
+    uint16_t dim;  /* split dimension */
 } KDTreeNode;
 
+/* how A##_create picks the split dimension (and position) of a node */
+typedef enum KDTreeSplit {
+    KDTREE_SPLIT_CYCLE,    /* next dimension in turn, at the median */
+    KDTREE_SPLIT_WIDEST,   /* dimension with the widest spread, at the median */
+    KDTREE_SPLIT_MIDPOINT, /* widest dimension, at the point closest above the middle of its spread */
+    KDTREE_SPLIT_VARIANCE, /* dimension with the largest variance, at the median */
+    KDTREE_SPLIT_RANDOM,   /* random one of the KDTREE_RANDOM_DIMS largest variances, at the median */
+} KDTreeSplit;
+
+/* KDTREE_SPLIT_RANDOM: one of the KDTREE_RANDOM_DIMS largest spreads, drawn from a
+ * hash of the seed and the subrange, so threaded builds come out the same */
+static inline size_t kdtree_split_random(const double *spread, size_t dim, uint64_t seed, size_t i0, size_t iE) {
+    size_t top[KDTREE_RANDOM_DIMS];
+    size_t n = 0;
+    for(size_t d = 0; d < dim; d++) {
+        if(spread[d] <= 0) continue;
+        /* keep top sorted, largest first */
+        size_t j;
+        if(n < KDTREE_RANDOM_DIMS) j = n++;
+        else if(spread[d] > spread[top[n - 1]]) j = n - 1;
+        else continue;
+        while(j && spread[top[j - 1]] < spread[d]) {
+            top[j] = top[j - 1];
+            j--;
+        }
+        top[j] = d;
+    }
+    if(!n) return 0;
+    /* splitmix64 */
+    uint64_t x = seed ^ ((uint64_t)i0 * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t)iE * 0xc2b2ae3d27d4eb4fULL);
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return top[x % n];
+}
+
+/* where trees get their memory from; 0 means malloc / realloc / free.
+ * Sizes are passed back on realloc and free for allocators that need them. */
+typedef struct KDTreeAllocator {
+    void *(*alloc)(void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *ptr, size_t old_size, size_t size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    void *ctx;
+} KDTreeAllocator;
+
+static inline void *kdtree_alloc(KDTreeAllocator *allocator, size_t size) {
+    if(!allocator) return malloc(size);
+    return allocator->alloc(allocator->ctx, size);
+}
+
+static inline void *kdtree_realloc(KDTreeAllocator *allocator, void *ptr, size_t old_size, size_t size) {
+    if(!allocator) return realloc(ptr, size);
+    return allocator->realloc(allocator->ctx, ptr, old_size, size);
+}
+
+static inline void kdtree_free(KDTreeAllocator *allocator, void *ptr, size_t size) {
+    if(!ptr) return;
+    if(!allocator) free(ptr);
+    else allocator->free(allocator->ctx, ptr, size);
+}
+
+/* bump allocator over a caller provided block (e.g. huge pages); only the most
+ * recent allocation can grow in place or be given back */
+typedef struct KDTreeArena {
+    char *mem;
+    size_t size;
+    size_t used;
+    size_t last; /* offset of the most recent allocation */
+} KDTreeArena;
+
+#define KDTREE_ARENA_ALIGN  16
+
+static inline void *kdtree_arena_alloc(void *ctx, size_t size) {
+    KDTreeArena *arena = ctx;
+    size_t at = (arena->used + KDTREE_ARENA_ALIGN - 1) & ~(size_t)(KDTREE_ARENA_ALIGN - 1);
+    if(at > arena->size || size > arena->size - at) return 0;
+    arena->last = at;
+    arena->used = at + size;
+    return arena->mem + at;
+}
+
+static inline void *kdtree_arena_realloc(void *ctx, void *ptr, size_t old_size, size_t size) {
+    KDTreeArena *arena = ctx;
+    if(!ptr) return kdtree_arena_alloc(ctx, size);
+    if((char *)ptr == arena->mem + arena->last && size <= arena->size - arena->last) {
+        arena->used = arena->last + size;
+        return ptr;
+    }
+    void *temp = kdtree_arena_alloc(ctx, size);
+    if(temp) memcpy(temp, ptr, old_size < size ? old_size : size);
+    return temp;
+}
+
+static inline void kdtree_arena_free(void *ctx, void *ptr, size_t size) {
+    KDTreeArena *arena = ctx;
+    (void)size;
+    if((char *)ptr == arena->mem + arena->last) arena->used = arena->last;
+}
+
+static inline KDTreeAllocator kdtree_arena_allocator(KDTreeArena *arena, void *mem, size_t size) {
+    assert(arena);
+    *arena = (KDTreeArena){ .mem = mem, .size = size };
+    return (KDTreeAllocator){
+        .alloc = kdtree_arena_alloc,
+        .realloc = kdtree_arena_realloc,
+        .free = kdtree_arena_free,
+        .ctx = arena,
+    };
+}
+
+/* set of marked buckets; a bucket is marked if its stamp equals the current
+ * epoch, so clearing all marks is just a new epoch */
+typedef struct KDTreeVisit {
+    uint32_t *stamp;
+    size_t len;
+    uint32_t epoch;
+    size_t generation; /* of the tree the set was made for */
+    KDTreeAllocator *allocator; /* set before init, if at all */
+} KDTreeVisit;
+
+static inline int kdtree_visit_init(KDTreeVisit *visit, size_t len) {
+    assert(visit);
+    visit->stamp = kdtree_alloc(visit->allocator, sizeof(*visit->stamp) * (len ? len : 1));
+    if(!visit->stamp) return -1;
+    memset(visit->stamp, 0, sizeof(*visit->stamp) * (len ? len : 1));
+    visit->len = len;
+    visit->epoch = 1;
+    return 0;
+}
+
+static inline void kdtree_visit_clear(KDTreeVisit *visit) {
+    assert(visit);
+    if(!++visit->epoch) {
+        /* wrapped around, old stamps could match again */
+        memset(visit->stamp, 0, sizeof(*visit->stamp) * visit->len);
+        visit->epoch = 1;
+    }
+}
+
+static inline bool kdtree_visit_marked(KDTreeVisit *visit, size_t i) {
+    assert(i < visit->len);
+    return visit->stamp[i] == visit->epoch;
+}
+
+static inline void kdtree_visit_mark(KDTreeVisit *visit, size_t i) {
+    assert(i < visit->len);
+    visit->stamp[i] = visit->epoch;
+}
+
+static inline int kdtree_visit_resize(KDTreeVisit *visit, size_t len) {
+    assert(visit);
+    if(len <= visit->len) return 0;
+    if(len < 2 * visit->len) len = 2 * visit->len;
+    uint32_t *temp = kdtree_realloc(visit->allocator, visit->stamp, sizeof(*temp) * (visit->len ? visit->len : 1), sizeof(*temp) * len);
+    if(!temp) return -1;
+    memset(temp + visit->len, 0, sizeof(*temp) * (len - visit->len));
+    visit->stamp = temp;
+    visit->len = len;
+    return 0;
+}
+
+/* reusable result buffers; once big enough, queries through it don't allocate */
+typedef struct KDTreeQuery {
+    size_t *idx;   /* indices into ref */
+    double *dist;  /* squared distances */
+    size_t len;    /* results of the last query */
+    size_t cap;    /* results both buffers have room for */
+    size_t idx_cap;  /* what each buffer was allocated with, */
+    size_t dist_cap; /* which may differ after a failed reserve */
+    void *scratch; /* priority queues of approximate searches */
+    size_t scratch_size;
+    bool sort;     /* order range results by distance */
+    KDTreeAllocator *allocator; /* set before the first query, if at all */
+} KDTreeQuery;
+
+/* called for every hit of A##_range_each; returning nonzero stops the query */
+typedef int (*KDTreeEach)(void *ctx, size_t index, double squared_dist);
+
+static inline int kdtree_query_reserve(KDTreeQuery *query, size_t cap) {
+    assert(query);
+    if(cap <= query->cap) return 0;
+    if(query->idx_cap < cap) {
+        size_t *idx = kdtree_realloc(query->allocator, query->idx, sizeof(*idx) * query->idx_cap, sizeof(*idx) * cap);
+        if(!idx) return -1;
+        query->idx = idx;
+        query->idx_cap = cap;
+    }
+    if(query->dist_cap < cap) {
+        double *dist = kdtree_realloc(query->allocator, query->dist, sizeof(*dist) * query->dist_cap, sizeof(*dist) * cap);
+        if(!dist) return -1;
+        query->dist = dist;
+        query->dist_cap = cap;
+    }
+    query->cap = cap;
+    return 0;
+}
+
+/* room for size bytes of scratch; 0 if that can't be had */
+static inline void *kdtree_query_reserve_scratch(KDTreeQuery *query, size_t size) {
+    assert(query);
+    if(size > query->scratch_size) {
+        void *temp = kdtree_realloc(query->allocator, query->scratch, query->scratch_size, size);
+        if(!temp) return 0;
+        query->scratch = temp;
+        query->scratch_size = size;
+    }
+    return query->scratch;
+}
+
+/* KDTreeEach appending to a KDTreeQuery */
+static inline int kdtree_query_push(void *ctx, size_t index, double squared_dist) {
+    KDTreeQuery *query = ctx;
+    if(query->len >= query->cap && kdtree_query_reserve(query, query->cap ? 2 * query->cap : 64)) return -1;
+    query->idx[query->len] = index;
+    query->dist[query->len] = squared_dist;
+    query->len++;
+    return 0;
+}
+
+static inline void kdtree_query_free(KDTreeQuery *query) {
+    assert(query);
+    kdtree_free(query->allocator, query->scratch, query->scratch_size);
+    kdtree_free(query->allocator, query->dist, sizeof(*query->dist) * query->dist_cap);
+    kdtree_free(query->allocator, query->idx, sizeof(*query->idx) * query->idx_cap);
+    memset(query, 0, sizeof(*query));
+}
+
+/* room for at least len nodes; exactly len the first time round */
+static inline int kdtree_node_reserve(KDTreeAllocator *allocator, KDTreeNode **nodes, size_t *cap, size_t len) {
+    if(len <= *cap) return 0;
+    size_t c = *cap ? *cap : len;
+    while(c < len) c *= 2;
+    KDTreeNode *temp = kdtree_realloc(allocator, *nodes, sizeof(*temp) * *cap, sizeof(*temp) * c);
+    if(!temp) return -1;
+    *nodes = temp;
+    *cap = c;
+    return 0;
+}
+
+static inline void kdtree_visit_free(KDTreeVisit *visit) {
+    assert(visit);
+    kdtree_free(visit->allocator, visit->stamp, sizeof(*visit->stamp) * (visit->len ? visit->len : 1));
+    memset(visit, 0, sizeof(*visit));
+}
+
 //VEC_INCLUDE(KDTreeBuckets, kdtree_buckets, KDTreeNode, BY_REF);
 
+/* on-disk format of A##_save: this header, the nodes, (with KDTREE_FILE_BOUNDS)
+ * the subtree counts, (with KDTREE_FILE_COORDS) the tree ordered copy of the
+ * points, then (KDTREE_FILE_BOUNDS again) the boxes. Nodes refer to each other
+ * by position only, so the file can be mapped anywhere. */
+#define KDTREE_FILE_MAGIC       "KDTREE\0"
+#define KDTREE_FILE_VERSION     1
+#define KDTREE_FILE_COORDS      0x1
+#define KDTREE_FILE_BOUNDS      0x2
+
+typedef struct KDTreeFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_size; /* sizeof(KDTreeNode) */
+    uint32_t type_size; /* sizeof(T) */
+    uint32_t flags;
+    uint64_t dim;
+    uint64_t stride;
+    uint64_t len;
+    uint64_t n_buckets;
+    uint64_t height;
+    uint64_t leaf_size;
+    uint64_t n_live;
+    uint64_t n_dead;
+    int64_t root;
+    uint32_t split;
+    uint32_t reserved;
+} KDTreeFileHeader;
+
+/* batch queries get processed in order of the tree position they land in */
+typedef struct KDTreeBatchKey {
+    size_t key;
+    size_t i;
+} KDTreeBatchKey;
+
+/* leaves get their distances computed in chunks of this many points */
+#ifndef KDTREE_LEAF_CHUNK
+#define KDTREE_LEAF_CHUNK   64
+#endif
+
+/* compile time check if T is U */
+#define KDTREE_TYPE_IS(T, U)    _Generic((T){0}, U: 1, default: 0)
+
+/* metrics, passed as M to KDTREE_INCLUDE_METRIC. A metric provides
+ * M##_TERM(tree, d, v)  what a coordinate difference v >= 0 along d adds; also
+ *                       what anything across a split along d is at least away
+ * M##_REDUCE(a, b)      how the terms add up
+ * M##_FLAGS             KDTREE_METRIC_SIMD for plain squared L2 (vectorized kernels),
+ *                       KDTREE_METRIC_SQUARED if distances are squared */
+#define KDTREE_METRIC_SIMD      0x1
+#define KDTREE_METRIC_SQUARED   0x2
+
+/* squared euclidean, the default */
+#define KDTREE_METRIC_L2_TERM(tree, d, v)       ((v) * (v))
+#define KDTREE_METRIC_L2_REDUCE(a, b)           ((a) + (b))
+#define KDTREE_METRIC_L2_FLAGS                  (KDTREE_METRIC_SIMD | KDTREE_METRIC_SQUARED)
+/* squared euclidean with tree->weights[d] per dimension */
+#define KDTREE_METRIC_WL2_TERM(tree, d, v)      ((tree)->weights[d] * (v) * (v))
+#define KDTREE_METRIC_WL2_REDUCE(a, b)          ((a) + (b))
+#define KDTREE_METRIC_WL2_FLAGS                 KDTREE_METRIC_SQUARED
+/* manhattan */
+#define KDTREE_METRIC_L1_TERM(tree, d, v)       (v)
+#define KDTREE_METRIC_L1_REDUCE(a, b)           ((a) + (b))
+#define KDTREE_METRIC_L1_FLAGS                  0
+/* chebyshev */
+#define KDTREE_METRIC_LINF_TERM(tree, d, v)     (v)
+#define KDTREE_METRIC_LINF_REDUCE(a, b)         ((a) > (b) ? (a) : (b))
+#define KDTREE_METRIC_LINF_FLAGS                0
+
+/* the metric M of tree N, in ACC */
+#define KDTREE_INCLUDE_METRIC_FUNCS(N, A, M) \
+    enum { A##_metric_flags = M##_FLAGS }; \
+    static inline N##Acc A##_metric_term(N *tree, size_t d, N##Acc v) { (void)tree; (void)d; return M##_TERM(tree, d, v); } \
+    static inline N##Acc A##_metric_sum(N##Acc a, N##Acc b) { return M##_REDUCE(a, b); } \
+    /* beyond any distance: infinity, or the largest value of an integer ACC */ \
+    static inline N##Acc A##_metric_far(void) { \
+        if((N##Acc)0.5) return (N##Acc)INFINITY; \
+        if((N##Acc)-1 > 0) return (N##Acc)-1; \
+        /* signed, all ones but the sign bit */ \
+        N##Acc max = 0; \
+        for(size_t i = 0; i + 1 < 8 * sizeof(max); i++) max = (N##Acc)(max * 2 + 1); \
+        return max; \
+    } \
+    /* a radius r of the API as what d < r compares against in ACC; integers \
+     * round up, and saturate */ \
+    static inline N##Acc A##_metric_radius(double r) { \
+        if((N##Acc)0.5) return (N##Acc)r; \
+        if(!(r > 0)) return 0; \
+        r = ceil(r); \
+        return r < (double)A##_metric_far() ? (N##Acc)r : A##_metric_far(); \
+    } \
+
+/* squared distance kernels for the common element types, vectorized with
+ * whatever -march provides and falling back to scalar for the tail */
+
+#pragma GCC diagnostic push
+/* vector loads are guarded by dim, which gcc can't see through */
+#pragma GCC diagnostic ignored "-Warray-bounds"
+
+static inline double kdtree_distance_f64(size_t dim, const double *x, const double *y) {
+    size_t i = 0;
+    double d = 0;
+#if defined(__AVX512F__)
+    if(dim >= 8) {
+        __m512d acc = _mm512_setzero_pd();
+        for(; i + 8 <= dim; i += 8) {
+            __m512d v = _mm512_sub_pd(_mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i));
+            acc = _mm512_add_pd(acc, _mm512_mul_pd(v, v));
+        }
+        d = _mm512_reduce_add_pd(acc);
+    }
+#elif defined(__AVX__)
+    if(dim >= 4) {
+        __m256d acc = _mm256_setzero_pd();
+        for(; i + 4 <= dim; i += 4) {
+            __m256d v = _mm256_sub_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i));
+            acc = _mm256_add_pd(acc, _mm256_mul_pd(v, v));
+        }
+        __m128d h = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+        d = _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+    }
+#elif defined(__SSE2__)
+    if(dim >= 2) {
+        __m128d acc = _mm_setzero_pd();
+        for(; i + 2 <= dim; i += 2) {
+            __m128d v = _mm_sub_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i));
+            acc = _mm_add_pd(acc, _mm_mul_pd(v, v));
+        }
+        d = _mm_cvtsd_f64(_mm_add_sd(acc, _mm_unpackhi_pd(acc, acc)));
+    }
+#endif
+    for(; i < dim; i++) {
+        double v = x[i] - y[i];
+        d += v * v;
+    }
+    return d;
+}
+
+static inline double kdtree_distance_f32(size_t dim, const float *x, const float *y) {
+    size_t i = 0;
+    double d = 0;
+#if defined(__AVX512F__)
+    if(dim >= 8) {
+        __m512d acc = _mm512_setzero_pd();
+        for(; i + 8 <= dim; i += 8) {
+            __m512d v = _mm512_sub_pd(_mm512_cvtps_pd(_mm256_loadu_ps(x + i)), _mm512_cvtps_pd(_mm256_loadu_ps(y + i)));
+            acc = _mm512_add_pd(acc, _mm512_mul_pd(v, v));
+        }
+        d = _mm512_reduce_add_pd(acc);
+    }
+#elif defined(__AVX__)
+    if(dim >= 4) {
+        __m256d acc = _mm256_setzero_pd();
+        for(; i + 4 <= dim; i += 4) {
+            __m256d v = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(x + i)), _mm256_cvtps_pd(_mm_loadu_ps(y + i)));
+            acc = _mm256_add_pd(acc, _mm256_mul_pd(v, v));
+        }
+        __m128d h = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+        d = _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+    }
+#endif
+    for(; i < dim; i++) {
+        double v = (double)x[i] - (double)y[i];
+        d += v * v;
+    }
+    return d;
+}
+
+/* same, summed up in float: twice the lanes, for trees that accumulate in float */
+static inline float kdtree_distance_f32f(size_t dim, const float *x, const float *y) {
+    size_t i = 0;
+    float d = 0;
+#if defined(__AVX512F__)
+    if(dim >= 16) {
+        __m512 acc = _mm512_setzero_ps();
+        for(; i + 16 <= dim; i += 16) {
+            __m512 v = _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i));
+            acc = _mm512_add_ps(acc, _mm512_mul_ps(v, v));
+        }
+        d = _mm512_reduce_add_ps(acc);
+    }
+#elif defined(__AVX__)
+    if(dim >= 8) {
+        __m256 acc = _mm256_setzero_ps();
+        for(; i + 8 <= dim; i += 8) {
+            __m256 v = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(v, v));
+        }
+        __m128 h = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+        d = _mm_cvtss_f32(_mm_add_ss(h, _mm_shuffle_ps(h, h, 1)));
+    }
+#elif defined(__SSE2__)
+    if(dim >= 4) {
+        __m128 acc = _mm_setzero_ps();
+        for(; i + 4 <= dim; i += 4) {
+            __m128 v = _mm_sub_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i));
+            acc = _mm_add_ps(acc, _mm_mul_ps(v, v));
+        }
+        acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+        d = _mm_cvtss_f32(_mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1)));
+    }
+#endif
+    for(; i < dim; i++) {
+        float v = x[i] - y[i];
+        d += v * v;
+    }
+    return d;
+}
+
+static inline double kdtree_distance_i32(size_t dim, const int32_t *x, const int32_t *y) {
+    size_t i = 0;
+    double d = 0;
+#if defined(__AVX512F__)
+    if(dim >= 8) {
+        __m512d acc = _mm512_setzero_pd();
+        for(; i + 8 <= dim; i += 8) {
+            __m512d v = _mm512_sub_pd(_mm512_cvtepi32_pd(_mm256_loadu_si256((const __m256i *)(x + i))), _mm512_cvtepi32_pd(_mm256_loadu_si256((const __m256i *)(y + i))));
+            acc = _mm512_add_pd(acc, _mm512_mul_pd(v, v));
+        }
+        d = _mm512_reduce_add_pd(acc);
+    }
+#elif defined(__AVX__)
+    if(dim >= 4) {
+        __m256d acc = _mm256_setzero_pd();
+        for(; i + 4 <= dim; i += 4) {
+            __m256d v = _mm256_sub_pd(_mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)(x + i))), _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)(y + i))));
+            acc = _mm256_add_pd(acc, _mm256_mul_pd(v, v));
+        }
+        __m128d h = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+        d = _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+    }
+#endif
+    for(; i < dim; i++) {
+        double v = (double)x[i] - (double)y[i];
+        d += v * v;
+    }
+    return d;
+}
+
+static inline uint64_t kdtree_distance_u8(size_t dim, const uint8_t *x, const uint8_t *y) {
+    size_t i = 0;
+    uint64_t d = 0;
+#if defined(__AVX2__)
+    while(i + 32 <= dim) {
+        /* flush before the 32-bit lanes could overflow */
+        size_t iE = i + 32 * 4096 < dim ? i + 32 * 4096 : dim;
+        __m256i acc = _mm256_setzero_si256();
+        __m256i zero = _mm256_setzero_si256();
+        for(; i + 32 <= iE; i += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(x + i));
+            __m256i b = _mm256_loadu_si256((const __m256i *)(y + i));
+            __m256i lo = _mm256_sub_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero));
+            __m256i hi = _mm256_sub_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(lo, lo));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(hi, hi));
+        }
+        uint32_t lanes[8];
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        for(size_t j = 0; j < 8; j++) d += lanes[j];
+    }
+#elif defined(__SSE2__)
+    while(i + 16 <= dim) {
+        size_t iE = i + 16 * 4096 < dim ? i + 16 * 4096 : dim;
+        __m128i acc = _mm_setzero_si128();
+        __m128i zero = _mm_setzero_si128();
+        for(; i + 16 <= iE; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(x + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(y + i));
+            __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+            __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+        }
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        for(size_t j = 0; j < 4; j++) d += lanes[j];
+    }
+#endif
+    for(; i < dim; i++) {
+        int v = (int)x[i] - (int)y[i];
+        d += (uint64_t)(v * v);
+    }
+    return d;
+}
+
+#pragma GCC diagnostic pop
+
+static inline int kdtree_static_batch_cmp(const void *a, const void *b) {
+    const KDTreeBatchKey *x = a;
+    const KDTreeBatchKey *y = b;
+    if(x->key != y->key) return x->key < y->key ? -1 : 1;
+    return x->i < y->i ? -1 : (x->i > y->i);
+}
+
 /*
  * N = name of the kdtree struct
  * A = abbreviation of the kdtree functions
  * T = name of the type struct
+ * D = dimension known at compile time (_DIM variants only)
  */
 
+/* D of 0 means the dimension is only known at runtime */
+#define KDTREE_DIM(tree, D)     ((D) ? (size_t)(D) : (tree)->dim)
+
 #define KDTREE_INCLUDE(N, A, T) \
+    KDTREE_INCLUDE_ACC(N, A, T, double)
+
+/* ACC is what squared distances get summed up and compared in */
+#define KDTREE_INCLUDE_ACC(N, A, T, ACC) \
+    KDTREE_INCLUDE_METRIC(N, A, T, ACC, KDTREE_METRIC_L2)
+
+/* M is one of KDTREE_METRIC_L2 / _WL2 / _L1 / _LINF or a prefix of your own */
+#define KDTREE_INCLUDE_METRIC(N, A, T, ACC, M) \
+    typedef ACC N##Acc; \
     typedef struct N { \
         KDTreeNode *buckets; \
+        size_t n_buckets; \
+        size_t cap_buckets; \
+        KDTreeVisit visit; /* marks of A##_nearest / A##_range */ \
         T* ref; \
         size_t len;   /* length of ref array */ \
         size_t dim;   /* count of dimensions */ \
         size_t stride; \
+        size_t leaf_size; /* max points per leaf, set before create (0 or 1: no leaves) */ \
+        bool presort; /* build from per-dimension sorted orders, set before create */ \
+        KDTreeSplit split; /* split policy, set before create */ \
+        double *weights; /* per dimension, for KDTREE_METRIC_WL2 */ \
+        double *period; /* per dimension box size for periodic boundaries (0: none), points in [0, size) */ \
+        uint64_t seed; /* of KDTREE_SPLIT_RANDOM, set before create */ \
+        bool copy; /* query a copy of the points kept in tree order, set before create */ \
+        T *coords; /* that copy, dim values per bucket */ \
+        size_t coords_cap; /* buckets the copy has room for */ \
+        bool bounds; /* keep a box and live point count per node, set before create */ \
+        T *boxes; /* per bucket: dim lower, then dim upper corners of its subtree */ \
+        size_t *sizes; /* per bucket: live points in its subtree */ \
+        size_t bounds_cap; /* buckets boxes and sizes have room for */ \
+        void *map; /* read only file mapping from A##_load_mmap */ \
+        KDTreeAllocator *allocator; /* set before create, 0: malloc */ \
+        size_t map_len; \
         ssize_t root; /* root returned from create */ \
+        size_t height; /* levels below root, bounds the traversal stack */ \
+        size_t n_live; /* points in the tree */ \
+        size_t n_dead; /* removed points still in the tree */ \
+        size_t generation; /* bumped whenever points move to other buckets */ \
     } N; \
     \
     int A##_create(N *tree , T *ref, size_t len, size_t dim, size_t offset, size_t stride); \
+    int A##_create_mt(N *tree , T *ref, size_t len, size_t dim, size_t offset, size_t stride, size_t n_threads); \
     ssize_t A##_nearest(N *tree , T *pt, double *squared_dist, bool mark); \
+    ssize_t A##_knearest(N *tree, T *pt, size_t k, size_t *idx_out, double *dist_out); \
+    ssize_t A##_nearest_approx(N *tree, KDTreeQuery *query, T *pt, double *squared_dist, double eps, size_t max_leaves, bool *exact); \
     ssize_t A##_range(N *tree, T *pt, double squared_dist, bool mark, size_t *pts, size_t len); \
+    ssize_t A##_knearest_query(N *tree, KDTreeQuery *query, T *pt, size_t k); \
+    ssize_t A##_range_query(N *tree, KDTreeQuery *query, T *pt, double squared_dist); \
+    ssize_t A##_range_each(N *tree, T *pt, double squared_dist, bool mark, KDTreeEach each, void *ctx); \
+    ssize_t A##_range_count(N *tree, T *pt, double squared_dist); \
+    bool A##_range_any(N *tree, T *pt, double squared_dist); \
+    ssize_t A##_box(N *tree, T *lo, T *hi, bool mark, size_t *pts, size_t len); \
+    ssize_t A##_box_each(N *tree, T *lo, T *hi, bool mark, KDTreeEach each, void *ctx); \
+    ssize_t A##_nearest_batch(N *tree, T *pts, size_t n, size_t stride, ssize_t *idx_out, double *dist_out); \
+    ssize_t A##_nearest_batch_mt(N *tree, T *pts, size_t n, size_t stride, ssize_t *idx_out, double *dist_out, size_t n_threads); \
+    ssize_t A##_range_batch(N *tree, T *pts, size_t n, size_t stride, double squared_dist, size_t *idx_out, double *dist_out, size_t len, ssize_t *counts); \
     void A##_mark_clear(N *tree); \
+    int A##_insert(N *tree, T *ref, size_t len, size_t index); \
+    int A##_remove(N *tree, size_t index); \
+    int A##_visit_create(N *tree, KDTreeVisit *visit); \
+    int A##_save(N *tree, const char *path); \
+    int A##_load_mmap(N *tree, const char *path, T *ref, size_t len); \
+    ssize_t A##_nearest_visit(N *tree, KDTreeVisit *visit, T *pt, double *squared_dist); \
+    ssize_t A##_range_visit(N *tree, KDTreeVisit *visit, T *pt, double squared_dist, size_t *pts, size_t len); \
     void A##_free(N *tree ); \
+    KDTREE_INCLUDE_METRIC_FUNCS(N, A, M) \
+    static inline double *A##_static_period(N *tree) { return tree->period; } \
+
+#define KDTREE_INCLUDE_DIM(N, A, T, D) \
+    KDTREE_INCLUDE(N, A, T)
 
 
 #define KDTREE_IMPLEMENT(N, A, T) \
-    KDTREE_IMPLEMENT_STATIC_GET_AT(N, A, T); \
-    KDTREE_IMPLEMENT_STATIC_MEDIAN(N, A, T); \
-    KDTREE_IMPLEMENT_STATIC_CREATE(N, A, T); \
-    KDTREE_IMPLEMENT_CREATE(N, A, T); \
-    KDTREE_IMPLEMENT_STATIC_DISTANCE(N, A, T); \
-    KDTREE_IMPLEMENT_STATIC_NEAREST(N, A, T); \
-    KDTREE_IMPLEMENT_NEAREST(N, A, T); \
-    KDTREE_IMPLEMENT_STATIC_RANGE(N, A, T); \
-    KDTREE_IMPLEMENT_RANGE(N, A, T); \
-    KDTREE_IMPLEMENT_CLEAR_MARK(N, A, T); \
-    KDTREE_IMPLEMENT_FREE(N, A, T); \
-
-#define KDTREE_IMPLEMENT_STATIC_GET_AT(N, A, T) \
+    KDTREE_IMPLEMENT_DIM(N, A, T, 0)
+
+#define KDTREE_IMPLEMENT_DIM(N, A, T, D) \
+    KDTREE_IMPLEMENT_STATIC_GET_AT(N, A, T, D); \
+    KDTREE_IMPLEMENT_STATIC_POINT(N, A, T, D); \
+    KDTREE_IMPLEMENT_STATIC_BOUNDS(N, A, T, D); \
+    KDTREE_IMPLEMENT_STATIC_MEDIAN(N, A, T, D); \
+    KDTREE_IMPLEMENT_STATIC_CREATE(N, A, T, D); \
+    KDTREE_IMPLEMENT_STATIC_PRESORT(N, A, T, D); \
+    KDTREE_IMPLEMENT_CREATE(N, A, T, D); \
+    KDTREE_IMPLEMENT_STATIC_DISTANCE(N, A, T, D); \
+    KDTREE_IMPLEMENT_STATIC_DISTANCE_LEAF(N, A, T, D); \
+    KDTREE_IMPLEMENT_STATIC_PLANE(N, A, T, D); \
+    KDTREE_IMPLEMENT_STATIC_STACK(N, A, T, D); \
+    KDTREE_IMPLEMENT_STATIC_NEAREST(N, A, T, D); \
+    KDTREE_IMPLEMENT_NEAREST(N, A, T, D); \
+    KDTREE_IMPLEMENT_STATIC_HEAP(A##_static_heap, N##Acc); \
+    KDTREE_IMPLEMENT_STATIC_KNEAREST(N, A, T, D); \
+    KDTREE_IMPLEMENT_KNEAREST(N, A, T, D); \
+    KDTREE_IMPLEMENT_NEAREST_APPROX(N, A, T, D); \
+    KDTREE_IMPLEMENT_STATIC_RANGE(N, A, T, D); \
+    KDTREE_IMPLEMENT_RANGE(N, A, T, D); \
+    KDTREE_IMPLEMENT_QUERY(N, A, T, D); \
+    KDTREE_IMPLEMENT_RANGE_COUNT(N, A, T, D); \
+    KDTREE_IMPLEMENT_BOX(N, A, T, D); \
+    KDTREE_IMPLEMENT_STATIC_LOCATE(N, A, T, D); \
+    KDTREE_IMPLEMENT_STATIC_BATCH_ORDER(N, A, T, D); \
+    KDTREE_IMPLEMENT_NEAREST_BATCH(N, A, T, D); \
+    KDTREE_IMPLEMENT_NEAREST_BATCH_MT(N, A, T, D); \
+    KDTREE_IMPLEMENT_RANGE_BATCH(N, A, T, D); \
+    KDTREE_IMPLEMENT_STATIC_COLLECT(N, A, T, D); \
+    KDTREE_IMPLEMENT_STATIC_REBUILD(N, A, T, D); \
+    KDTREE_IMPLEMENT_INSERT(N, A, T, D); \
+    KDTREE_IMPLEMENT_REMOVE(N, A, T, D); \
+    KDTREE_IMPLEMENT_CLEAR_MARK(N, A, T, D); \
+    KDTREE_IMPLEMENT_FREE(N, A, T, D); \
+    KDTREE_IMPLEMENT_SAVE(N, A, T, D); \
+    KDTREE_IMPLEMENT_LOAD_MMAP(N, A, T, D); \
+
+#define KDTREE_IMPLEMENT_STATIC_GET_AT(N, A, T, D) \
     T A##_static_get_at(T *ref, size_t index, size_t len) { \
         if(KDTREE_DEBUG) { \
             ASSERT(index < len, "accessing index %zu / len %zu", index, len); \
@@ -89,121 +744,2155 @@ typedef struct KDTreeNode {
         return ref[index]; \
     }
 
-#define KDTREE_IMPLEMENT_STATIC_MEDIAN(N, A, T) \
-    static inline ssize_t A##_static_median(N *tree , size_t i0, size_t iE, size_t i_dim) { \
+#define KDTREE_IMPLEMENT_STATIC_POINT(N, A, T, D) \
+    /* coordinates of bucket i, from the copy if there is one */ \
+    static inline T *A##_static_point(N *tree, size_t i) { \
+        if(tree->coords) return &tree->coords[i * KDTREE_DIM(tree, D)]; \
+        return &tree->ref[tree->buckets[i].index]; \
+    } \
+    /* refresh the copy of buckets [i0, iE) after they got (re)built */ \
+    static int A##_static_copy(N *tree, size_t i0, size_t iE) { \
+        if(!tree->copy) return 0; \
+        size_t dim = KDTREE_DIM(tree, D); \
+        if(tree->coords_cap < tree->n_buckets) { \
+            size_t cap = tree->coords_cap ? tree->coords_cap : tree->n_buckets; \
+            while(cap < tree->n_buckets) cap *= 2; \
+            T *temp = kdtree_realloc(tree->allocator, tree->coords, sizeof(*temp) * dim * tree->coords_cap, sizeof(*temp) * dim * cap); \
+            if(!temp) return -1; \
+            tree->coords = temp; \
+            tree->coords_cap = cap; \
+        } \
+        for(size_t i = i0; i < iE; i++) { \
+            memcpy(&tree->coords[i * dim], &tree->ref[tree->buckets[i].index], sizeof(T) * dim); \
+        } \
+        return 0; \
+    }
+
+#define KDTREE_IMPLEMENT_STATIC_BOUNDS(N, A, T, D) \
+    static size_t A##_static_bound(N *tree, ssize_t root) { \
+        if(root < 0) return 0; \
+        size_t dim = KDTREE_DIM(tree, D); \
+        KDTreeNode *node = &tree->buckets[root]; \
+        T *lo = &tree->boxes[2 * dim * root]; \
+        T *hi = lo + dim; \
+        memcpy(lo, A##_static_point(tree, root), sizeof(T) * dim); \
+        memcpy(hi, lo, sizeof(T) * dim); \
+        size_t size = 0; \
+        size_t count = node->leaf ? node->leaf : 1; \
+        for(size_t i = root; i < root + count; i++) { \
+            T *p = A##_static_point(tree, i); \
+            for(size_t d = 0; d < dim; d++) { \
+                if(p[d] < lo[d]) lo[d] = p[d]; \
+                if(p[d] > hi[d]) hi[d] = p[d]; \
+            } \
+            size += !tree->buckets[i].dead; \
+        } \
+        if(!node->leaf) { \
+            ssize_t child[2] = { node->left, node->right }; \
+            for(size_t c = 0; c < 2; c++) { \
+                if(child[c] < 0) continue; \
+                size += A##_static_bound(tree, child[c]); \
+                T *c_lo = &tree->boxes[2 * dim * child[c]]; \
+                T *c_hi = c_lo + dim; \
+                for(size_t d = 0; d < dim; d++) { \
+                    if(c_lo[d] < lo[d]) lo[d] = c_lo[d]; \
+                    if(c_hi[d] > hi[d]) hi[d] = c_hi[d]; \
+                } \
+            } \
+        } \
+        tree->sizes[root] = size; \
+        return size; \
+    } \
+    /* (re)compute the boxes and counts of a subtree, if the tree keeps them */ \
+    static int A##_static_bounds(N *tree, ssize_t root) { \
+        if(!tree->bounds) return 0; \
+        size_t dim = KDTREE_DIM(tree, D); \
+        if(tree->bounds_cap < tree->n_buckets) { \
+            size_t cap = tree->bounds_cap ? tree->bounds_cap : tree->n_buckets; \
+            while(cap < tree->n_buckets) cap *= 2; \
+            T *boxes = kdtree_realloc(tree->allocator, tree->boxes, sizeof(*boxes) * 2 * dim * tree->bounds_cap, sizeof(*boxes) * 2 * dim * cap); \
+            if(!boxes) return -1; \
+            tree->boxes = boxes; \
+            size_t *sizes = kdtree_realloc(tree->allocator, tree->sizes, sizeof(*sizes) * tree->bounds_cap, sizeof(*sizes) * cap); \
+            if(!sizes) return -1; \
+            tree->sizes = sizes; \
+            tree->bounds_cap = cap; \
+        } \
+        A##_static_bound(tree, root); \
+        return 0; \
+    } \
+    /* a point got added to (delta 1, pt given) or removed from (delta -1) below bucket i */ \
+    static inline void A##_static_bounds_update(N *tree, size_t i, T *pt, int delta) { \
+        if(!tree->bounds) return; \
+        size_t dim = KDTREE_DIM(tree, D); \
+        tree->sizes[i] += delta; \
+        if(!pt) return; \
+        T *lo = &tree->boxes[2 * dim * i]; \
+        T *hi = lo + dim; \
+        for(size_t d = 0; d < dim; d++) { \
+            if(pt[d] < lo[d]) lo[d] = pt[d]; \
+            if(pt[d] > hi[d]) hi[d] = pt[d]; \
+        } \
+    }
+
+#define KDTREE_IMPLEMENT_STATIC_MEDIAN(N, A, T, D) \
+    static inline T A##_static_value(N *tree, size_t i, size_t i_dim) { \
+        return A##_static_get_at(tree->ref, tree->buckets[i].index + i_dim, tree->len); \
+    } \
+    static inline void A##_static_isort(N *tree, size_t i0, size_t iE, size_t i_dim) { \
+        for(size_t i = i0 + 1; i < iE; i++) { \
+            for(size_t j = i; j > i0 && A##_static_value(tree, j, i_dim) < A##_static_value(tree, j - 1, i_dim); j--) { \
+                KDTREE_SWAP(tree->buckets[j].index, tree->buckets[j - 1].index); \
+            } \
+        } \
+    } \
+    static size_t A##_static_select(N *tree, size_t i0, size_t iE, size_t k, size_t i_dim, size_t depth); \
+    /* median of medians of 5, guarantees a 30/70 split */ \
+    static T A##_static_pivot_mom(N *tree, size_t i0, size_t iE, size_t i_dim) { \
+        size_t g = 0; \
+        for(size_t j = i0; j < iE; j += 5) { \
+            size_t e = j + 5 < iE ? j + 5 : iE; \
+            A##_static_isort(tree, j, e, i_dim); \
+            KDTREE_SWAP(tree->buckets[j + (e - j - 1) / 2].index, tree->buckets[i0 + g].index); \
+            g++; \
+        } \
+        size_t m = A##_static_select(tree, i0, i0 + g, i0 + g / 2, i_dim, 0); \
+        return A##_static_value(tree, m, i_dim); \
+    } \
+    /* introselect: median of 3 pivots until depth runs out, then median of medians. \
+     * The 3-way partition keeps runs of equal values from degrading it. */ \
+    static size_t A##_static_select(N *tree, size_t i0, size_t iE, size_t k, size_t i_dim, size_t depth) { \
+        while(iE - i0 > 16) { \
+            T pivot; \
+            if(!depth) { \
+                pivot = A##_static_pivot_mom(tree, i0, iE, i_dim); \
+            } else { \
+                depth--; \
+                T a = A##_static_value(tree, i0, i_dim); \
+                T b = A##_static_value(tree, i0 + (iE - i0) / 2, i_dim); \
+                T c = A##_static_value(tree, iE - 1, i_dim); \
+                if(a < b) pivot = b < c ? b : (a < c ? c : a); \
+                else pivot = a < c ? a : (b < c ? c : b); \
+            } \
+            /* [i0, lt) < pivot, [lt, gt) == pivot, [gt, iE) > pivot */ \
+            size_t lt = i0; \
+            size_t gt = iE; \
+            size_t i = i0; \
+            while(i < gt) { \
+                T v = A##_static_value(tree, i, i_dim); \
+                if(v < pivot) { \
+                    KDTREE_SWAP(tree->buckets[lt].index, tree->buckets[i].index); \
+                    lt++; \
+                    i++; \
+                } else if(v > pivot) { \
+                    gt--; \
+                    KDTREE_SWAP(tree->buckets[i].index, tree->buckets[gt].index); \
+                } else { \
+                    i++; \
+                } \
+            } \
+            if(k < lt) iE = lt; \
+            else if(k >= gt) i0 = gt; \
+            else return k; \
+        } \
+        A##_static_isort(tree, i0, iE, i_dim); \
+        return k; \
+    } \
+    /* puts the k-th smallest of [i0, iE) at k, smaller or equal values before it, \
+     * larger or equal ones after it */ \
+    static inline ssize_t A##_static_nth(N *tree , size_t i0, size_t iE, size_t k, size_t i_dim) { \
         assert(tree); \
         assert(tree->ref); \
         if(iE <= i0) return -1LL; \
-        if(iE == i0 + 1) return i0; \
-        size_t md = i0 + (iE - i0) / 2; \
-        size_t store = 0; \
-        size_t p = 0; \
-        for(;;) { \
-            size_t i_pivot = tree->buckets[md].index; \
-            T pivot = A##_static_get_at(tree->ref, i_pivot + i_dim, tree->len); \
-            KDTREE_SWAP(tree->buckets[md].index, tree->buckets[iE - 1].index); \
-            store = i0; \
-            for(p = i0; p < iE - 1; p++) { \
-                size_t i_p = tree->buckets[p].index; \
-                T p_x = A##_static_get_at(tree->ref, i_p + i_dim, tree->len); \
-                if(p_x < pivot) { \
-                    if(p != store) { \
-                        KDTREE_SWAP(tree->buckets[p].index, tree->buckets[store].index); \
-                    } \
-                    store++; \
-                    assert(store < array_len(tree->buckets)); \
-                } \
+        size_t depth = 0; \
+        for(size_t n = iE - i0; n > 1; n >>= 1) depth += 2; \
+        return A##_static_select(tree, i0, iE, k, i_dim, depth); \
+    } \
+    static inline ssize_t A##_static_median(N *tree , size_t i0, size_t iE, size_t i_dim) { \
+        return A##_static_nth(tree, i0, iE, i0 + (iE - i0) / 2, i_dim); \
+    } \
+    /* picks the split dimension of [i0, iE) as per tree->split (i_dim in, \
+     * chosen one out) and puts the splitting point in place */ \
+    static ssize_t A##_static_split(N *tree, size_t i0, size_t iE, size_t *i_dim) { \
+        size_t dim = KDTREE_DIM(tree, D); \
+        if(iE <= i0) return -1LL; \
+        if(tree->split == KDTREE_SPLIT_CYCLE || dim == 1 || iE - i0 == 1) { \
+            return A##_static_median(tree, i0, iE, *i_dim); \
+        } \
+        /* one pass over the points, row by row */ \
+        double lo[dim], hi[dim], sum[dim], sum2[dim]; \
+        for(size_t d = 0; d < dim; d++) { \
+            lo[d] = hi[d] = (double)A##_static_value(tree, i0, d); \
+            sum[d] = sum2[d] = 0; \
+        } \
+        for(size_t i = i0; i < iE; i++) { \
+            T *p = &tree->ref[tree->buckets[i].index]; \
+            for(size_t d = 0; d < dim; d++) { \
+                double v = (double)p[d]; \
+                if(v < lo[d]) lo[d] = v; \
+                if(v > hi[d]) hi[d] = v; \
+                /* shifted by the first point against cancellation */ \
+                double x = v - (double)tree->ref[tree->buckets[i0].index + d]; \
+                sum[d] += x; \
+                sum2[d] += x * x; \
             } \
-            KDTREE_SWAP(tree->buckets[store].index, tree->buckets[iE - 1].index); \
-            /* median has duplicate values */ \
-            size_t i_s = tree->buckets[store].index; \
-            T v_s = A##_static_get_at(tree->ref, i_s + i_dim, tree->len); \
-            size_t i_m = tree->buckets[md].index; \
-            T v_m = A##_static_get_at(tree->ref, i_m + i_dim, tree->len); \
-            if(v_s == v_m) { return md; } \
-            if(store > md) iE = store; \
-            else i0 = store; \
         } \
-        return 0; \
+        double best = 0; \
+        double spread[dim]; \
+        for(size_t d = 0; d < dim; d++) { \
+            double n = (double)(iE - i0); \
+            spread[d] = tree->split == KDTREE_SPLIT_VARIANCE || tree->split == KDTREE_SPLIT_RANDOM ? sum2[d] / n - (sum[d] / n) * (sum[d] / n) : hi[d] - lo[d]; \
+            if(spread[d] > best) { \
+                best = spread[d]; \
+                *i_dim = d; \
+            } \
+        } \
+        if(best > 0 && tree->split == KDTREE_SPLIT_RANDOM) { \
+            *i_dim = kdtree_split_random(spread, dim, tree->seed, i0, iE); \
+        } \
+        /* all points equal */ \
+        if(best <= 0 || tree->split != KDTREE_SPLIT_MIDPOINT) { \
+            return A##_static_median(tree, i0, iE, *i_dim); \
+        } \
+        /* slide to the first point at or above the middle */ \
+        double mid = lo[*i_dim] + (hi[*i_dim] - lo[*i_dim]) / 2; \
+        size_t k = i0; \
+        for(size_t i = i0; i < iE; i++) { \
+            if((double)A##_static_value(tree, i, *i_dim) < mid) k++; \
+        } \
+        if(k >= iE) k = iE - 1; \
+        return A##_static_nth(tree, i0, iE, k, *i_dim); \
     }
 
-#define KDTREE_IMPLEMENT_STATIC_CREATE(N, A, T) \
-    static inline ssize_t A##_static_create(N *tree , size_t i0, size_t iE, size_t i_dim) { \
+#define KDTREE_IMPLEMENT_STATIC_CREATE(N, A, T, D) \
+    typedef struct N##CreateTask { \
+        N *tree; \
+        size_t i0; \
+        size_t iE; \
+        size_t i_dim; \
+        size_t n_threads; \
+        size_t height; \
+        ssize_t result; \
+    } N##CreateTask; \
+    static inline ssize_t A##_static_create(N *tree , size_t i0, size_t iE, size_t i_dim, size_t n_threads, size_t *height); \
+    static void *A##_static_create_task(void *arg) { \
+        N##CreateTask *task = arg; \
+        task->result = A##_static_create(task->tree, task->i0, task->iE, task->i_dim, task->n_threads, &task->height); \
+        return 0; \
+    } \
+    static inline ssize_t A##_static_create(N *tree , size_t i0, size_t iE, size_t i_dim, size_t n_threads, size_t *height) { \
         assert(tree->ref); \
+        *height = 0; \
         if(!iE) return -1LL; \
-        ssize_t m = A##_static_median(tree, i0, iE, i_dim); \
+        if(tree->leaf_size > 1 && iE > i0 && iE - i0 <= tree->leaf_size) { \
+            /* small enough, no need to select any further */ \
+            for(size_t i = i0; i < iE; i++) { \
+                KDTreeNode *n = &tree->buckets[i]; \
+                n->left = -1; \
+                n->right = -1; \
+            } \
+            tree->buckets[i0].leaf = (uint32_t)(iE - i0); \
+            *height = 1; \
+            return i0; \
+        } \
+        ssize_t m = A##_static_split(tree, i0, iE, &i_dim); \
         if(m >= 0) { \
-            i_dim = (i_dim + 1) % tree->dim; \
-            KDTreeNode *n = array_it(tree->buckets, m); \
-            n->left = A##_static_create(tree, i0, m, i_dim); \
-            n->right = A##_static_create(tree, m + 1, iE, i_dim); \
+            KDTreeNode *n = &tree->buckets[m]; \
+            n->dim = (uint16_t)i_dim; \
+            if(++i_dim >= KDTREE_DIM(tree, D)) i_dim = 0; \
+            size_t height_left = 0; \
+            size_t height_right = 0; \
+            bool done = false; \
+            /* both halves only touch their own subrange, so the left one can go to \
+             * another thread without changing the result */ \
+            if(n_threads > 1 && iE - i0 >= KDTREE_PARALLEL_MIN) { \
+                N##CreateTask task = { \
+                    .tree = tree, \
+                    .i0 = i0, \
+                    .iE = m, \
+                    .i_dim = i_dim, \
+                    .n_threads = n_threads / 2, \
+                }; \
+                pthread_t thread; \
+                if(!pthread_create(&thread, 0, A##_static_create_task, &task)) { \
+                    n->right = A##_static_create(tree, m + 1, iE, i_dim, n_threads - n_threads / 2, &height_right); \
+                    pthread_join(thread, 0); \
+                    n->left = task.result; \
+                    height_left = task.height; \
+                    done = true; \
+                } \
+            } \
+            if(!done) { \
+                n->left = A##_static_create(tree, i0, m, i_dim, 1, &height_left); \
+                n->right = A##_static_create(tree, m + 1, iE, i_dim, 1, &height_right); \
+            } \
+            *height = 1 + (height_left > height_right ? height_left : height_right); \
         } \
         return m; \
     }
 
-#define KDTREE_IMPLEMENT_CREATE(N, A, T) \
-    int A##_create(N *tree , T *ref, size_t len, size_t dim, size_t offset, size_t stride) { \
+#define KDTREE_IMPLEMENT_STATIC_PRESORT(N, A, T, D) \
+    /* stable merge sort of ids by their coordinate in i_dim */ \
+    static void A##_static_sort(N *tree, size_t *ids, size_t *tmp, size_t n, size_t i_dim, size_t *points) { \
+        size_t *src = ids; \
+        size_t *dst = tmp; \
+        for(size_t w = 1; w < n; w *= 2) { \
+            for(size_t lo = 0; lo < n; lo += 2 * w) { \
+                size_t mid = lo + w < n ? lo + w : n; \
+                size_t hi = lo + 2 * w < n ? lo + 2 * w : n; \
+                size_t l = lo, r = mid, o = lo; \
+                while(l < mid && r < hi) { \
+                    T a = A##_static_get_at(tree->ref, points[src[l]] + i_dim, tree->len); \
+                    T b = A##_static_get_at(tree->ref, points[src[r]] + i_dim, tree->len); \
+                    dst[o++] = b < a ? src[r++] : src[l++]; \
+                } \
+                while(l < mid) dst[o++] = src[l++]; \
+                while(r < hi) dst[o++] = src[r++]; \
+            } \
+            size_t *t = src; src = dst; dst = t; \
+        } \
+        if(src != ids) memcpy(ids, src, sizeof(*ids) * n); \
+    } \
+    /* the median is simply the middle of orders[i_dim]; the other orders get \
+     * split the same way, keeping them sorted */ \
+    static ssize_t A##_static_presort_create(N *tree, size_t i0, size_t iE, size_t i_dim, size_t **orders, size_t *points, uint8_t *side, size_t *scratch, size_t *height) { \
+        *height = 0; \
+        if(iE <= i0) return -1LL; \
+        if(tree->leaf_size > 1 && iE - i0 <= tree->leaf_size) { \
+            for(size_t i = i0; i < iE; i++) { \
+                KDTreeNode *n = &tree->buckets[i]; \
+                n->index = points[orders[0][i]]; \
+                n->left = -1; \
+                n->right = -1; \
+            } \
+            tree->buckets[i0].leaf = (uint32_t)(iE - i0); \
+            *height = 1; \
+            return i0; \
+        } \
+        size_t dim = KDTREE_DIM(tree, D); \
+        size_t m = i0 + (iE - i0) / 2; \
+        if(tree->split != KDTREE_SPLIT_CYCLE && dim > 1) { \
+            /* the ends of the orders give the spreads right away */ \
+            double best = 0; \
+            double spread[dim]; \
+            for(size_t d = 0; d < dim; d++) { \
+                if(tree->split == KDTREE_SPLIT_VARIANCE || tree->split == KDTREE_SPLIT_RANDOM) { \
+                    double sum = 0, sum2 = 0; \
+                    T x0 = tree->ref[points[orders[d][i0]] + d]; \
+                    for(size_t i = i0; i < iE; i++) { \
+                        double x = (double)tree->ref[points[orders[d][i]] + d] - (double)x0; \
+                        sum += x; \
+                        sum2 += x * x; \
+                    } \
+                    double n = (double)(iE - i0); \
+                    spread[d] = sum2 / n - (sum / n) * (sum / n); \
+                } else { \
+                    spread[d] = (double)tree->ref[points[orders[d][iE - 1]] + d] - (double)tree->ref[points[orders[d][i0]] + d]; \
+                } \
+                if(spread[d] > best) { \
+                    best = spread[d]; \
+                    i_dim = d; \
+                } \
+            } \
+            if(best > 0 && tree->split == KDTREE_SPLIT_RANDOM) { \
+                i_dim = kdtree_split_random(spread, dim, tree->seed, i0, iE); \
+            } \
+            if(best > 0 && tree->split == KDTREE_SPLIT_MIDPOINT) { \
+                size_t *o = orders[i_dim]; \
+                double mid = ((double)tree->ref[points[o[i0]] + i_dim] + (double)tree->ref[points[o[iE - 1]] + i_dim]) / 2; \
+                /* first point at or above the middle */ \
+                size_t l = i0, r = iE - 1; \
+                while(l < r) { \
+                    size_t h = l + (r - l) / 2; \
+                    if((double)tree->ref[points[o[h]] + i_dim] < mid) l = h + 1; \
+                    else r = h; \
+                } \
+                m = l; \
+            } \
+        } \
+        size_t *o = orders[i_dim]; \
+        for(size_t i = i0; i < iE; i++) side[o[i]] = i < m ? 0 : (i > m ? 1 : 2); \
+        for(size_t d = 0; d < dim; d++) { \
+            if(d == i_dim) continue; \
+            size_t l = i0; \
+            size_t r = 0; \
+            for(size_t i = i0; i < iE; i++) { \
+                size_t id = orders[d][i]; \
+                if(side[id] == 0) orders[d][l++] = id; \
+                else if(side[id] == 1) scratch[r++] = id; \
+            } \
+            assert(l == m); \
+            assert(r == iE - m - 1); \
+            memcpy(orders[d] + m + 1, scratch, sizeof(*scratch) * r); \
+        } \
+        KDTreeNode *n = &tree->buckets[m]; \
+        n->index = points[o[m]]; \
+        n->dim = (uint16_t)i_dim; \
+        if(++i_dim >= dim) i_dim = 0; \
+        size_t height_left = 0; \
+        size_t height_right = 0; \
+        n->left = A##_static_presort_create(tree, i0, m, i_dim, orders, points, side, scratch, &height_left); \
+        n->right = A##_static_presort_create(tree, m + 1, iE, i_dim, orders, points, side, scratch, &height_right); \
+        *height = 1 + (height_left > height_right ? height_left : height_right); \
+        return m; \
+    } \
+    /* O(n log n) whatever the data, at the cost of dim + 2 index arrays */ \
+    static int A##_static_presort_build(N *tree) { \
+        size_t n = tree->n_buckets; \
+        size_t dim = KDTREE_DIM(tree, D); \
+        size_t **orders = kdtree_alloc(tree->allocator, sizeof(*orders) * dim); \
+        size_t *mem = kdtree_alloc(tree->allocator, sizeof(*mem) * n * (dim + 2)); \
+        uint8_t *side = kdtree_alloc(tree->allocator, n ? n : 1); \
+        if(!orders || !mem || !side) { \
+            kdtree_free(tree->allocator, side, n ? n : 1); \
+            kdtree_free(tree->allocator, mem, sizeof(*mem) * n * (dim + 2)); \
+            kdtree_free(tree->allocator, orders, sizeof(*orders) * dim); \
+            return -1; \
+        } \
+        size_t *points = mem + n * dim; \
+        size_t *scratch = points + n; \
+        for(size_t i = 0; i < n; i++) points[i] = tree->buckets[i].index; \
+        for(size_t d = 0; d < dim; d++) { \
+            orders[d] = mem + n * d; \
+            for(size_t i = 0; i < n; i++) orders[d][i] = i; \
+            A##_static_sort(tree, orders[d], scratch, n, d, points); \
+        } \
+        tree->root = A##_static_presort_create(tree, 0, n, 0, orders, points, side, scratch, &tree->height); \
+        kdtree_free(tree->allocator, side, n ? n : 1); \
+        kdtree_free(tree->allocator, mem, sizeof(*mem) * n * (dim + 2)); \
+        kdtree_free(tree->allocator, orders, sizeof(*orders) * dim); \
+        return 0; \
+    }
+
+#define KDTREE_IMPLEMENT_CREATE(N, A, T, D) \
+    int A##_create_mt(N *tree , T *ref, size_t len, size_t dim, size_t offset, size_t stride, size_t n_threads) { \
         assert(dim); \
         assert(tree); \
         assert(ref); \
+        assert(tree->leaf_size <= UINT32_MAX); \
+        assert(!D || dim == D); \
+        assert(dim <= UINT16_MAX); \
         tree->ref = ref; \
         tree->dim = dim; \
         if(!stride) stride = dim; \
         tree->stride = stride; \
+        size_t count = offset < len ? (len - offset + stride - 1) / stride : 0; \
+        if(kdtree_node_reserve(tree->allocator, &tree->buckets, &tree->cap_buckets, tree->n_buckets + count)) return -1; \
         for(size_t i = offset; i < len; i += stride) { \
-            array_push(tree->buckets, (KDTreeNode){.index = i}); \
+            tree->buckets[tree->n_buckets++] = (KDTreeNode){.index = i}; \
         } \
-        tree->len = array_len(tree->buckets) * tree->dim; \
-        tree->root = A##_static_create(tree, 0, array_len(tree->buckets), 0); \
-        return 0; \
+        tree->len = len; \
+        tree->n_live = tree->n_buckets; \
+        tree->n_dead = 0; \
+        tree->visit.allocator = tree->allocator; \
+        if(kdtree_visit_init(&tree->visit, tree->n_buckets)) return -1; \
+        tree->visit.generation = tree->generation; \
+        /* falls back to selecting if the orders don't fit in memory */ \
+        if(!tree->presort || A##_static_presort_build(tree)) { \
+            tree->root = A##_static_create(tree, 0, tree->n_buckets, 0, n_threads, &tree->height); \
+        } \
+        if(A##_static_copy(tree, 0, tree->n_buckets)) return -1; \
+        return A##_static_bounds(tree, tree->root); \
+    } \
+    int A##_create(N *tree , T *ref, size_t len, size_t dim, size_t offset, size_t stride) { \
+        return A##_create_mt(tree, ref, len, dim, offset, stride, 1); \
     }
 
-#define KDTREE_IMPLEMENT_STATIC_DISTANCE(N, A, T) \
-    double A##_static_distance(size_t dim, T *x, T *y) { \
-        double d = 0; \
+#define KDTREE_IMPLEMENT_STATIC_DISTANCE(N, A, T, D) \
+    N##Acc A##_static_distance(N *tree, size_t dim, T *x, T *y) { \
+        /* resolved at compile time */ \
+        if(D) dim = D; \
+        double *period = A##_static_period(tree); \
+        if(period) { \
+            /* minimum image */ \
+            N##Acc d = 0; \
+            for(size_t i = 0; i < dim; i++) { \
+                double w = fabs((double)x[i] - (double)y[i]); \
+                if(period[i] > 0) { \
+                    w = fmod(w, period[i]); \
+                    if(w > period[i] - w) w = period[i] - w; \
+                } \
+                d = A##_metric_sum(d, A##_metric_term(tree, i, (N##Acc)w)); \
+            } \
+            return d; \
+        } \
+        if((A##_metric_flags & KDTREE_METRIC_SIMD) && !(D && D <= 4)) { \
+            if(KDTREE_TYPE_IS(T, double)) return (N##Acc)kdtree_distance_f64(dim, (const double *)x, (const double *)y); \
+            if(KDTREE_TYPE_IS(T, float) && KDTREE_TYPE_IS(N##Acc, float)) return (N##Acc)kdtree_distance_f32f(dim, (const float *)x, (const float *)y); \
+            if(KDTREE_TYPE_IS(T, float)) return (N##Acc)kdtree_distance_f32(dim, (const float *)x, (const float *)y); \
+            if(KDTREE_TYPE_IS(T, int32_t)) return (N##Acc)kdtree_distance_i32(dim, (const int32_t *)x, (const int32_t *)y); \
+            if(KDTREE_TYPE_IS(T, uint8_t)) return (N##Acc)kdtree_distance_u8(dim, (const uint8_t *)x, (const uint8_t *)y); \
+        } \
+        /* fully unrolled for small D */ \
+        N##Acc d = 0; \
         for(size_t i = 0; i < dim; i++) { \
-            d += (x[i] - y[i]) * (x[i] - y[i]); \
+            N##Acc v = x[i] > y[i] ? (N##Acc)x[i] - (N##Acc)y[i] : (N##Acc)y[i] - (N##Acc)x[i]; \
+            d = A##_metric_sum(d, A##_metric_term(tree, i, v)); \
         } \
         return d; \
     }
 
-#define KDTREE_IMPLEMENT_STATIC_NEAREST(N, A, T) \
-    static inline void A##_static_nearest(N* tree, ssize_t root, T* pt, size_t i_dim, ssize_t *best, double *best_dist, bool mark) { \
+#define KDTREE_IMPLEMENT_STATIC_DISTANCE_LEAF(N, A, T, D) \
+    /* one query against n points of a leaf */ \
+    static inline void A##_static_distance_leaf(N *tree, T *pt, size_t i0, size_t n, N##Acc *out) { \
+        for(size_t j = 0; j < n; j++) { \
+            out[j] = A##_static_distance(tree, KDTREE_DIM(tree, D), pt, A##_static_point(tree, i0 + j)); \
+        } \
+    }
+
+#define KDTREE_IMPLEMENT_STATIC_PLANE(N, A, T, D) \
+    /* lower bound on the distance from b to the far side of a split at a along d; \
+     * splitting_dist gets b - a, the sign telling the near side. With a period, \
+     * b gets wrapped into [0, size) and the far side is also within b (left of \
+     * it) or size - b (right of it) across the boundary. */ \
+    static inline N##Acc A##_static_plane(N *tree, size_t d, T a, T b, double *splitting_dist) { \
+        double *period = A##_static_period(tree); \
+        if(period && period[d] > 0) { \
+            double size = period[d]; \
+            double w = (double)b - size * floor((double)b / size); \
+            double gap = fabs(w - (double)a); \
+            double wrap = w <= (double)a ? w : size - w; \
+            if(wrap < gap) gap = wrap; \
+            *splitting_dist = w - (double)a; \
+            return A##_metric_term(tree, d, (N##Acc)gap); \
+        } \
+        *splitting_dist = (double)b - (double)a; \
+        /* the same difference the distance takes, so it never exceeds it */ \
+        N##Acc gap = b > a ? (N##Acc)b - (N##Acc)a : (N##Acc)a - (N##Acc)b; \
+        return A##_metric_term(tree, d, gap); \
+    }
+
+#define KDTREE_IMPLEMENT_STATIC_STACK(N, A, T, D) \
+    /* pending subtree of an iterative traversal; bound is the distance to its \
+     * splitting plane */ \
+    typedef struct N##StackItem { \
+        ssize_t node; \
+        N##Acc bound; \
+    } N##StackItem;
+
+#define KDTREE_IMPLEMENT_STATIC_NEAREST(N, A, T, D) \
+    static inline void A##_static_nearest(N* tree, ssize_t root, T* pt, ssize_t *best, N##Acc *best_dist, KDTreeVisit *visit) { \
         if(root < 0) return; \
-        /* Get the current node from the KDTree */ \
-        KDTreeNode* node = array_it(tree->buckets, root); \
-        /*printf("node indx !! %zi\n", node->index);*/ \
-        /* Calculate the distance from the target point to the current node */ \
-        double current_distance = A##_static_distance(tree->dim, pt, &(tree->ref[node->index])); \
-        if(((mark && !node->mark) || !mark) && (*best < 0 || current_distance < *best_dist)) { \
+        /* every level pushes at most one further subtree */ \
+        N##StackItem stack[tree->height + 1]; \
+        size_t n_stack = 0; \
+        stack[n_stack++] = (N##StackItem){ .node = root, .bound = 0 }; \
+        while(n_stack) { \
+            N##StackItem item = stack[--n_stack]; \
+            /* Search the further subtree only if necessary */ \
+            if(item.bound >= *best_dist) continue; \
+            root = item.node; \
+            while(root >= 0) { \
+                /* Get the current node from the KDTree */ \
+                KDTreeNode* node = &tree->buckets[root]; \
+                if(node->leaf) { \
+                    N##Acc d[KDTREE_LEAF_CHUNK]; \
+                    for(size_t j0 = root; j0 < root + node->leaf; j0 += KDTREE_LEAF_CHUNK) { \
+                        size_t n = root + node->leaf - j0 < KDTREE_LEAF_CHUNK ? root + node->leaf - j0 : KDTREE_LEAF_CHUNK; \
+                        A##_static_distance_leaf(tree, pt, j0, n, d); \
+                        for(size_t j = 0; j < n; j++) { \
+                            if(!tree->buckets[j0 + j].dead && (!visit || !kdtree_visit_marked(visit, j0 + j)) && (*best < 0 || d[j] < *best_dist)) { \
+                                *best = j0 + j; \
+                                *best_dist = d[j]; \
+                            } \
+                        } \
+                    } \
+                    break; \
+                } \
+                /* Calculate the distance from the target point to the current node */ \
+                N##Acc current_distance = A##_static_distance(tree, KDTREE_DIM(tree, D), pt, A##_static_point(tree, root)); \
+                if(!node->dead && (!visit || !kdtree_visit_marked(visit, root)) && (*best < 0 || current_distance < *best_dist)) { \
+                    *best = root; \
+                    *best_dist = current_distance; \
+                } \
+                /* a removed or marked point at distance 0 doesn't end the search */ \
+                if(!*best_dist) { break; } \
+                /* Calculate the distance from the target point to the splitting dimension of the current node */ \
+                T a = A##_static_point(tree, root)[node->dim]; \
+                T b = A##_static_get_at(pt, node->dim, KDTREE_DIM(tree, D)); \
+                double splitting_dist; \
+                N##Acc dx2 = A##_static_plane(tree, node->dim, a, b, &splitting_dist); \
+                /* Traverse the KDTree based on the splitting dimension and the distance to the target */ \
+                ssize_t nearer_node; \
+                ssize_t further_node; \
+                if (splitting_dist <= 0) { \
+                    nearer_node = node->left; \
+                    further_node = node->right; \
+                } else { \
+                    nearer_node = node->right; \
+                    further_node = node->left; \
+                } \
+                if(further_node >= 0 && dx2 < *best_dist) { \
+                    assert(n_stack <= tree->height); \
+                    stack[n_stack++] = (N##StackItem){ .node = further_node, .bound = dx2 }; \
+                } \
+                /* Continue with the nearer subtree */ \
+                root = nearer_node; \
+            } \
+        } \
+    }
+
+#define KDTREE_IMPLEMENT_NEAREST(N, A, T, D); \
+    ssize_t A##_nearest_visit(N *tree, KDTreeVisit *visit, T *pt, double *squared_dist) { \
+        assert(tree); \
+        assert(pt); \
+        double temp_dist = 0; \
+        if(!squared_dist) squared_dist = &temp_dist; \
+        *squared_dist = INFINITY; \
+        /* sets from before an insert or remove moved the points are stale */ \
+        if(visit && (visit->len < tree->n_buckets || visit->generation != tree->generation)) return -1; \
+        ssize_t i = -1; \
+        N##Acc best_dist = A##_metric_far(); \
+        A##_static_nearest(tree, tree->root, pt, &i, &best_dist, visit); \
+        if(i < 0) return -1; \
+        *squared_dist = best_dist; \
+        KDTreeNode *node = &tree->buckets[i]; \
+        if(visit) kdtree_visit_mark(visit, i); \
+        return node->index; \
+    } \
+    ssize_t A##_nearest(N *tree, T *pt, double *squared_dist, bool mark) { \
+        /* only write marks when asked to, so that unmarked queries can run concurrently */ \
+        return A##_nearest_visit(tree, mark ? &tree->visit : 0, pt, squared_dist); \
+    }
+
+#define KDTREE_IMPLEMENT_STATIC_HEAP(F, V) \
+    /* bounded max-heap of candidates with distances of type V, largest at [0] */ \
+    static inline void F##_swap(size_t *idx, V *dist, size_t i, size_t j) { \
+        size_t ti = idx[i]; idx[i] = idx[j]; idx[j] = ti; \
+        V td = dist[i]; dist[i] = dist[j]; dist[j] = td; \
+    } \
+    static inline void F##_down(size_t *idx, V *dist, size_t len, size_t i) { \
+        for(;;) { \
+            size_t l = 2 * i + 1; \
+            size_t r = l + 1; \
+            size_t m = i; \
+            if(l < len && dist[l] > dist[m]) m = l; \
+            if(r < len && dist[r] > dist[m]) m = r; \
+            if(m == i) return; \
+            F##_swap(idx, dist, i, m); \
+            i = m; \
+        } \
+    } \
+    static inline void F##_push(size_t *idx, V *dist, size_t *len, size_t k, size_t i, V d) { \
+        if(*len < k) { \
+            size_t c = (*len)++; \
+            idx[c] = i; \
+            dist[c] = d; \
+            while(c) { \
+                size_t p = (c - 1) / 2; \
+                if(dist[p] >= dist[c]) break; \
+                F##_swap(idx, dist, p, c); \
+                c = p; \
+            } \
+        } else if(d < dist[0]) { \
+            idx[0] = i; \
+            dist[0] = d; \
+            F##_down(idx, dist, *len, 0); \
+        } \
+    } \
+    /* turn the heap into ascending order */ \
+    static inline void F##_sort(size_t *idx, V *dist, size_t len) { \
+        for(size_t n = len; n > 1; n--) { \
+            F##_swap(idx, dist, 0, n - 1); \
+            F##_down(idx, dist, n - 1, 0); \
+        } \
+    }
+
+#define KDTREE_IMPLEMENT_STATIC_KNEAREST(N, A, T, D) \
+    static inline void A##_static_knearest(N* tree, ssize_t root, T* pt, size_t k, size_t *idx, N##Acc *dist, size_t *len) { \
+        if(root < 0) return; \
+        N##StackItem stack[tree->height + 1]; \
+        size_t n_stack = 0; \
+        stack[n_stack++] = (N##StackItem){ .node = root, .bound = 0 }; \
+        while(n_stack) { \
+            N##StackItem item = stack[--n_stack]; \
+            /* prune against the current k-th best once the heap is full */ \
+            if(*len == k && item.bound >= dist[0]) continue; \
+            root = item.node; \
+            while(root >= 0) { \
+                KDTreeNode* node = &tree->buckets[root]; \
+                if(node->leaf) { \
+                    N##Acc d[KDTREE_LEAF_CHUNK]; \
+                    for(size_t j0 = root; j0 < root + node->leaf; j0 += KDTREE_LEAF_CHUNK) { \
+                        size_t n = root + node->leaf - j0 < KDTREE_LEAF_CHUNK ? root + node->leaf - j0 : KDTREE_LEAF_CHUNK; \
+                        A##_static_distance_leaf(tree, pt, j0, n, d); \
+                        for(size_t j = 0; j < n; j++) { \
+                            if(tree->buckets[j0 + j].dead) continue; \
+                            A##_static_heap_push(idx, dist, len, k, j0 + j, d[j]); \
+                        } \
+                    } \
+                    break; \
+                } \
+                N##Acc current_distance = A##_static_distance(tree, KDTREE_DIM(tree, D), pt, A##_static_point(tree, root)); \
+                if(!node->dead) A##_static_heap_push(idx, dist, len, k, root, current_distance); \
+                if(*len == k && !dist[0]) { break; } \
+                T a = A##_static_point(tree, root)[node->dim]; \
+                T b = A##_static_get_at(pt, node->dim, KDTREE_DIM(tree, D)); \
+                double splitting_dist; \
+                N##Acc dx2 = A##_static_plane(tree, node->dim, a, b, &splitting_dist); \
+                ssize_t nearer_node; \
+                ssize_t further_node; \
+                if (splitting_dist <= 0) { \
+                    nearer_node = node->left; \
+                    further_node = node->right; \
+                } else { \
+                    nearer_node = node->right; \
+                    further_node = node->left; \
+                } \
+                if(further_node >= 0 && (*len < k || dx2 < dist[0])) { \
+                    assert(n_stack <= tree->height); \
+                    stack[n_stack++] = (N##StackItem){ .node = further_node, .bound = dx2 }; \
+                } \
+                root = nearer_node; \
+            } \
+        } \
+    }
+
+#define KDTREE_IMPLEMENT_KNEAREST(N, A, T, D) \
+    /* the k nearest in ascending order, with dist (room for k) as the heap; \
+     * dist_out gets them as double unless it is dist itself */ \
+    static inline size_t A##_static_knearest_sorted(N *tree, T *pt, size_t k, size_t *idx_out, N##Acc *dist, double *dist_out) { \
+        size_t len = 0; \
+        A##_static_knearest(tree, tree->root, pt, k, idx_out, dist, &len); \
+        A##_static_heap_sort(idx_out, dist, len); \
+        for(size_t i = 0; i < len; i++) { \
+            idx_out[i] = tree->buckets[idx_out[i]].index; \
+            if(dist_out && (void *)dist_out != (void *)dist) dist_out[i] = dist[i]; \
+        } \
+        return len; \
+    } \
+    ssize_t A##_knearest(N *tree, T *pt, size_t k, size_t *idx_out, double *dist_out) { \
+        assert(tree); \
+        assert(pt); \
+        assert(idx_out); \
+        if(!k) return 0; \
+        /* dist_out can hold the heap itself if ACC is double */ \
+        bool own = !dist_out || !KDTREE_TYPE_IS(N##Acc, double); \
+        N##Acc *dist = own ? malloc(sizeof(*dist) * k) : (N##Acc *)dist_out; \
+        if(!dist) return -1; \
+        size_t len = A##_static_knearest_sorted(tree, pt, k, idx_out, dist, dist_out); \
+        if(own) free(dist); \
+        return (ssize_t)len; \
+    }
+
+#define KDTREE_IMPLEMENT_STATIC_BIN(F, I) \
+    /* min-heap of pending subtrees of item type I (anything with a bound), \
+     * smallest bound at [0] */ \
+    static inline void F##_push(I *heap, size_t *len, I item) { \
+        size_t c = (*len)++; \
+        while(c) { \
+            size_t p = (c - 1) / 2; \
+            if(heap[p].bound <= item.bound) break; \
+            heap[c] = heap[p]; \
+            c = p; \
+        } \
+        heap[c] = item; \
+    } \
+    static inline I F##_pop(I *heap, size_t *len) { \
+        I top = heap[0]; \
+        I last = heap[--(*len)]; \
+        size_t i = 0; \
+        for(;;) { \
+            size_t m = 2 * i + 1; \
+            if(m >= *len) break; \
+            if(m + 1 < *len && heap[m + 1].bound < heap[m].bound) m++; \
+            if(last.bound <= heap[m].bound) break; \
+            heap[i] = heap[m]; \
+            i = m; \
+        } \
+        if(*len) heap[i] = last; \
+        return top; \
+    }
+
+#define KDTREE_IMPLEMENT_NEAREST_APPROX(N, A, T, D) \
+    /* closest live point of one node (all of it for a leaf) */ \
+    static inline void A##_static_approx_node(N *tree, ssize_t root, T *pt, ssize_t *best, N##Acc *best_dist) { \
+        KDTreeNode *node = &tree->buckets[root]; \
+        if(!node->leaf) { \
+            N##Acc d = A##_static_distance(tree, KDTREE_DIM(tree, D), pt, A##_static_point(tree, root)); \
+            if(!node->dead && (*best < 0 || d < *best_dist)) { \
+                *best = root; \
+                *best_dist = d; \
+            } \
+            return; \
+        } \
+        size_t iE = root + node->leaf; \
+        N##Acc d[KDTREE_LEAF_CHUNK]; \
+        for(size_t j0 = root; j0 < iE; j0 += KDTREE_LEAF_CHUNK) { \
+            size_t n = iE - j0 < KDTREE_LEAF_CHUNK ? iE - j0 : KDTREE_LEAF_CHUNK; \
+            A##_static_distance_leaf(tree, pt, j0, n, d); \
+            for(size_t j = 0; j < n; j++) { \
+                if(!tree->buckets[j0 + j].dead && (*best < 0 || d[j] < *best_dist)) { \
+                    *best = j0 + j; \
+                    *best_dist = d[j]; \
+                } \
+            } \
+        } \
+    } \
+    KDTREE_IMPLEMENT_STATIC_BIN(A##_static_bin, N##StackItem) \
+    /* walk down the nearer side to the bottom; further sides that may still hold \
+     * a point closer than best / shrink go onto the stack, or the heap if bin */ \
+    static inline void A##_static_approx_descend(N *tree, ssize_t root, T *pt, double shrink, ssize_t *best, N##Acc *best_dist, N##StackItem *pending, size_t *n_pending, bool bin, bool *exact) { \
+        while(root >= 0) { \
+            KDTreeNode *node = &tree->buckets[root]; \
+            A##_static_approx_node(tree, root, pt, best, best_dist); \
+            if(node->leaf || !*best_dist) break; \
+            T a = A##_static_point(tree, root)[node->dim]; \
+            T b = A##_static_get_at(pt, node->dim, KDTREE_DIM(tree, D)); \
+            double splitting_dist; \
+            N##Acc dx2 = A##_static_plane(tree, node->dim, a, b, &splitting_dist); \
+            ssize_t nearer_node = splitting_dist <= 0 ? node->left : node->right; \
+            ssize_t further_node = splitting_dist <= 0 ? node->right : node->left; \
+            if(further_node >= 0 && dx2 * shrink < *best_dist) { \
+                N##StackItem item = { .node = further_node, .bound = dx2 }; \
+                if(bin) A##_static_bin_push(pending, n_pending, item); \
+                else pending[(*n_pending)++] = item; \
+            } else if(further_node >= 0 && dx2 < *best_dist) { \
+                *exact = false; \
+            } \
+            root = nearer_node; \
+        } \
+    } \
+    /* (1+eps)-approximate nearest: subtrees get skipped unless they could hold a \
+     * point closer than best / (1+eps), squared for squared metrics. With max_leaves, subtrees are \
+     * searched closest first (best bin first) and the search stops after that \
+     * many descents to a leaf, keeping its queue in query. exact reports whether \
+     * nothing closer was skipped. */ \
+    ssize_t A##_nearest_approx(N *tree, KDTreeQuery *query, T *pt, double *squared_dist, double eps, size_t max_leaves, bool *exact) { \
+        assert(tree); \
+        assert(query || !max_leaves); \
+        assert(pt); \
+        assert(eps >= 0); \
+        double temp_dist = 0; \
+        bool temp_exact = true; \
+        if(!squared_dist) squared_dist = &temp_dist; \
+        if(!exact) exact = &temp_exact; \
+        *squared_dist = INFINITY; \
+        *exact = true; \
+        if(tree->root < 0) return -1; \
+        double shrink = A##_metric_flags & KDTREE_METRIC_SQUARED ? (1 + eps) * (1 + eps) : 1 + eps; \
+        ssize_t best = -1; \
+        N##Acc best_dist = A##_metric_far(); \
+        if(!max_leaves) { \
+            N##StackItem stack[tree->height + 1]; \
+            size_t n_stack = 0; \
+            stack[n_stack++] = (N##StackItem){ .node = tree->root, .bound = 0 }; \
+            while(n_stack) { \
+                N##StackItem item = stack[--n_stack]; \
+                if(item.bound * shrink >= best_dist) { \
+                    if(item.bound < best_dist) *exact = false; \
+                    continue; \
+                } \
+                A##_static_approx_descend(tree, item.node, pt, shrink, &best, &best_dist, stack, &n_stack, false, exact); \
+            } \
+        } else { \
+            /* every descent queues at most one subtree per level */ \
+            size_t cap = max_leaves < tree->n_buckets / (tree->height + 1) ? max_leaves * (tree->height + 1) + 1 : tree->n_buckets + 1; \
+            N##StackItem *heap = kdtree_query_reserve_scratch(query, sizeof(*heap) * cap); \
+            if(!heap) return -1; \
+            size_t n_heap = 0; \
+            size_t n_leaves = 0; \
+            A##_static_bin_push(heap, &n_heap, (N##StackItem){ .node = tree->root, .bound = 0 }); \
+            while(n_heap) { \
+                N##StackItem item = A##_static_bin_pop(heap, &n_heap); \
+                /* the rest is at least as far */ \
+                if(item.bound >= best_dist) break; \
+                if(item.bound * shrink >= best_dist || n_leaves++ == max_leaves) { \
+                    *exact = false; \
+                    break; \
+                } \
+                A##_static_approx_descend(tree, item.node, pt, shrink, &best, &best_dist, heap, &n_heap, true, exact); \
+                assert(n_heap <= cap); \
+            } \
+        } \
+        if(best < 0) return -1; \
+        *squared_dist = best_dist; \
+        return tree->buckets[best].index; \
+    }
+
+#define KDTREE_IMPLEMENT_STATIC_RANGE(N, A, T, D) \
+    static inline int A##_static_range(N* tree, ssize_t root, T *pt, size_t *pts, double *dists, size_t len, ssize_t *i, N##Acc range_dist, KDTreeVisit *visit, KDTreeEach each, void *ctx) { \
+        if(root < 0) return 0; \
+        N##StackItem stack[tree->height + 1]; \
+        size_t n_stack = 0; \
+        stack[n_stack++] = (N##StackItem){ .node = root, .bound = 0 }; \
+        while(n_stack) { \
+            N##StackItem item = stack[--n_stack]; \
+            root = item.node; \
+            while(root >= 0) { \
+                /* Get the current node from the KDTree */ \
+                KDTreeNode* node = &tree->buckets[root]; \
+                if(node->leaf) { \
+                    N##Acc d[KDTREE_LEAF_CHUNK]; \
+                    for(size_t j0 = root; j0 < root + node->leaf; j0 += KDTREE_LEAF_CHUNK) { \
+                        size_t n = root + node->leaf - j0 < KDTREE_LEAF_CHUNK ? root + node->leaf - j0 : KDTREE_LEAF_CHUNK; \
+                        A##_static_distance_leaf(tree, pt, j0, n, d); \
+                        for(size_t j = 0; j < n; j++) { \
+                            KDTreeNode *p = &tree->buckets[j0 + j]; \
+                            if(p->dead || (visit && kdtree_visit_marked(visit, j0 + j))) continue; \
+                            if(d[j] < range_dist) { \
+                                if(!each && *i >= len) { \
+                                    return -1; \
+                                } \
+                                if(visit) kdtree_visit_mark(visit, j0 + j); \
+                                if(each) { \
+                                    (*i)++; \
+                                    int result = each(ctx, p->index, d[j]); \
+                                    if(result) return result; \
+                                    continue; \
+                                } \
+                                if(pts) pts[*i] = p->index; \
+                                if(dists) dists[*i] = d[j]; \
+                                (*i)++; \
+                            } \
+                        } \
+                    } \
+                    break; \
+                } \
+                T a = A##_static_point(tree, root)[node->dim]; \
+                /* Calculate the distance from the target point to the current node */ \
+                N##Acc current_distance = A##_static_distance(tree, KDTREE_DIM(tree, D), pt, A##_static_point(tree, root)); \
+                if(!node->dead && (!visit || !kdtree_visit_marked(visit, root)) && (current_distance < range_dist)) { \
+                    if(!each && *i >= len) { \
+                        return -1; \
+                    } \
+                    if(visit) kdtree_visit_mark(visit, root); \
+                    if(each) { \
+                        (*i)++; \
+                        int result = each(ctx, node->index, current_distance); \
+                        if(result) return result; \
+                    } else { \
+                        if(pts) pts[*i] = node->index; \
+                        if(dists) dists[*i] = current_distance; \
+                        (*i)++; \
+                    } \
+                } \
+                /* Calculate the distance from the target point to the splitting dimension of the current node */ \
+                T b = A##_static_get_at(pt, node->dim, KDTREE_DIM(tree, D)); \
+                double splitting_dist; \
+                N##Acc dx2 = A##_static_plane(tree, node->dim, a, b, &splitting_dist); \
+                /* Traverse the KDTree based on the splitting dimension and the distance to the target */ \
+                ssize_t nearer_node; \
+                ssize_t further_node; \
+                if (splitting_dist <= 0) { \
+                    nearer_node = node->left; \
+                    further_node = node->right; \
+                } else { \
+                    nearer_node = node->right; \
+                    further_node = node->left; \
+                } \
+                /* Search the further subtree only if necessary */ \
+                if(further_node >= 0 && dx2 < range_dist) { \
+                    assert(n_stack <= tree->height); \
+                    stack[n_stack++] = (N##StackItem){ .node = further_node, .bound = dx2 }; \
+                } \
+                root = nearer_node; \
+            } \
+        } \
+        return 0; \
+    }
+
+#define KDTREE_IMPLEMENT_RANGE(N, A, T, D); \
+    ssize_t A##_range_visit(N *tree, KDTreeVisit *visit, T *pt, double squared_dist, size_t *pts, size_t len) { \
+        assert(tree); \
+        assert(pt); \
+        if(visit && (visit->len < tree->n_buckets || visit->generation != tree->generation)) return -1; \
+        ssize_t used = 0; \
+        ssize_t result = (ssize_t)A##_static_range(tree, tree->root, pt, pts, 0, len, &used, A##_metric_radius(squared_dist), visit, 0, 0); \
+        return result < 0 ? result : used; \
+    } \
+    ssize_t A##_range(N *tree, T *pt, double squared_dist, bool mark, size_t *pts, size_t len) { \
+        return A##_range_visit(tree, mark ? &tree->visit : 0, pt, squared_dist, pts, len); \
+    } \
+    /* each may be 0 to just count; returns the hits reported */ \
+    ssize_t A##_range_each(N *tree, T *pt, double squared_dist, bool mark, KDTreeEach each, void *ctx) { \
+        assert(tree); \
+        assert(pt); \
+        ssize_t used = 0; \
+        A##_static_range(tree, tree->root, pt, 0, 0, SIZE_MAX, &used, A##_metric_radius(squared_dist), mark ? &tree->visit : 0, each, ctx); \
+        return used; \
+    }
+
+#define KDTREE_IMPLEMENT_QUERY(N, A, T, D) \
+    /* range results are already double */ \
+    KDTREE_IMPLEMENT_STATIC_HEAP(A##_static_result_heap, double) \
+    ssize_t A##_knearest_query(N *tree, KDTreeQuery *query, T *pt, size_t k) { \
+        assert(tree); \
+        assert(query); \
+        assert(pt); \
+        query->len = 0; \
+        if(!k) return 0; \
+        if(kdtree_query_reserve(query, k)) return -1; \
+        /* the heap goes to query->dist right away if ACC is double */ \
+        N##Acc *dist = KDTREE_TYPE_IS(N##Acc, double) ? (N##Acc *)query->dist : kdtree_query_reserve_scratch(query, sizeof(*dist) * k); \
+        if(!dist) return -1; \
+        query->len = A##_static_knearest_sorted(tree, pt, k, query->idx, dist, query->dist); \
+        return (ssize_t)query->len; \
+    } \
+    ssize_t A##_range_query(N *tree, KDTreeQuery *query, T *pt, double squared_dist) { \
+        assert(tree); \
+        assert(query); \
+        assert(pt); \
+        query->len = 0; \
+        ssize_t used = 0; \
+        if(A##_static_range(tree, tree->root, pt, 0, 0, 0, &used, A##_metric_radius(squared_dist), 0, kdtree_query_push, query)) return -1; \
+        if(query->sort) { \
+            for(size_t i = query->len / 2; i-- > 0; ) { \
+                A##_static_result_heap_down(query->idx, query->dist, query->len, i); \
+            } \
+            A##_static_result_heap_sort(query->idx, query->dist, query->len); \
+        } \
+        return (ssize_t)query->len; \
+    }
+
+#define KDTREE_IMPLEMENT_RANGE_COUNT(N, A, T, D) \
+    static int A##_static_any(void *ctx, size_t index, double squared_dist) { \
+        (void)ctx; \
+        (void)index; \
+        (void)squared_dist; \
+        return 1; \
+    } \
+    /* with boxes, subtrees entirely in range are counted without descending */ \
+    static size_t A##_static_count(N *tree, T *pt, N##Acc range_dist, bool any) { \
+        if(tree->root < 0) return 0; \
+        size_t dim = KDTREE_DIM(tree, D); \
+        ssize_t stack[tree->height + 1]; \
+        size_t n_stack = 0; \
+        size_t count = 0; \
+        stack[n_stack++] = tree->root; \
+        while(n_stack) { \
+            ssize_t root = stack[--n_stack]; \
+            KDTreeNode *node = &tree->buckets[root]; \
+            T *lo = &tree->boxes[2 * dim * root]; \
+            T *hi = lo + dim; \
+            N##Acc near = 0; \
+            N##Acc far = 0; \
+            for(size_t d = 0; d < dim; d++) { \
+                N##Acc to_lo = pt[d] > lo[d] ? (N##Acc)pt[d] - (N##Acc)lo[d] : (N##Acc)lo[d] - (N##Acc)pt[d]; \
+                N##Acc to_hi = hi[d] > pt[d] ? (N##Acc)hi[d] - (N##Acc)pt[d] : (N##Acc)pt[d] - (N##Acc)hi[d]; \
+                if(pt[d] < lo[d]) near = A##_metric_sum(near, A##_metric_term(tree, d, to_lo)); \
+                else if(pt[d] > hi[d]) near = A##_metric_sum(near, A##_metric_term(tree, d, to_hi)); \
+                far = A##_metric_sum(far, A##_metric_term(tree, d, to_lo > to_hi ? to_lo : to_hi)); \
+            } \
+            if(near >= range_dist || !tree->sizes[root]) continue; \
+            if(far < range_dist) { \
+                count += tree->sizes[root]; \
+                if(any) return count; \
+                continue; \
+            } \
+            size_t n = node->leaf ? node->leaf : 1; \
+            for(size_t i = root; i < root + n; i++) { \
+                if(tree->buckets[i].dead) continue; \
+                if(A##_static_distance(tree, dim, pt, A##_static_point(tree, i)) < range_dist) { \
+                    count++; \
+                    if(any) return count; \
+                } \
+            } \
+            if(node->leaf) continue; \
+            assert(n_stack + 2 <= tree->height + 1); \
+            if(node->left >= 0) stack[n_stack++] = node->left; \
+            if(node->right >= 0) stack[n_stack++] = node->right; \
+        } \
+        return count; \
+    } \
+    ssize_t A##_range_count(N *tree, T *pt, double squared_dist) { \
+        assert(tree); \
+        assert(pt); \
+        /* boxes don't wrap */ \
+        if(!tree->boxes || tree->period) return A##_range_each(tree, pt, squared_dist, false, 0, 0); \
+        return (ssize_t)A##_static_count(tree, pt, A##_metric_radius(squared_dist), false); \
+    } \
+    bool A##_range_any(N *tree, T *pt, double squared_dist) { \
+        assert(tree); \
+        assert(pt); \
+        if(!tree->boxes || tree->period) return A##_range_each(tree, pt, squared_dist, false, A##_static_any, 0) > 0; \
+        return A##_static_count(tree, pt, A##_metric_radius(squared_dist), true) > 0; \
+    }
+
+#define KDTREE_IMPLEMENT_BOX(N, A, T, D) \
+    /* points with lo <= p <= hi in every dimension; hits go to pts (up to len, \
+     * -1 past that) or to each. Subtrees whose box lies inside get reported \
+     * without testing, or just counted if nothing needs to be written. */ \
+    static int A##_static_box(N *tree, T *lo, T *hi, size_t *pts, size_t len, ssize_t *i, KDTreeVisit *visit, KDTreeEach each, void *ctx) { \
+        if(tree->root < 0) return 0; \
+        size_t dim = KDTREE_DIM(tree, D); \
+        struct { ssize_t node; bool inside; } stack[tree->height + 1]; \
+        size_t n_stack = 0; \
+        stack[n_stack].node = tree->root; \
+        stack[n_stack++].inside = false; \
+        while(n_stack) { \
+            n_stack--; \
+            ssize_t root = stack[n_stack].node; \
+            bool inside = stack[n_stack].inside; \
+            KDTreeNode *node = &tree->buckets[root]; \
+            if(!inside && tree->boxes) { \
+                T *b_lo = &tree->boxes[2 * dim * root]; \
+                T *b_hi = b_lo + dim; \
+                bool outside = false; \
+                inside = true; \
+                for(size_t d = 0; d < dim; d++) { \
+                    if(b_hi[d] < lo[d] || b_lo[d] > hi[d]) outside = true; \
+                    if(b_lo[d] < lo[d] || b_hi[d] > hi[d]) inside = false; \
+                } \
+                if(outside) continue; \
+                if(inside && !pts && !each && !visit) { \
+                    *i += tree->sizes[root]; \
+                    continue; \
+                } \
+            } \
+            size_t n = node->leaf ? node->leaf : 1; \
+            for(size_t j = root; j < root + n; j++) { \
+                KDTreeNode *p = &tree->buckets[j]; \
+                if(p->dead || (visit && kdtree_visit_marked(visit, j))) continue; \
+                if(!inside) { \
+                    T *x = A##_static_point(tree, j); \
+                    size_t d = 0; \
+                    while(d < dim && lo[d] <= x[d] && x[d] <= hi[d]) d++; \
+                    if(d < dim) continue; \
+                } \
+                if(!each && *i >= len) return -1; \
+                if(visit) kdtree_visit_mark(visit, j); \
+                (*i)++; \
+                if(each) { \
+                    int result = each(ctx, p->index, 0); \
+                    if(result) return result; \
+                } else if(pts) { \
+                    pts[*i - 1] = p->index; \
+                } \
+            } \
+            if(node->leaf) continue; \
+            /* left holds values <= the split, right ones >= it */ \
+            T a = A##_static_point(tree, root)[node->dim]; \
+            assert(n_stack + 2 <= tree->height + 1); \
+            if(node->left >= 0 && (inside || lo[node->dim] <= a)) { \
+                stack[n_stack].node = node->left; \
+                stack[n_stack++].inside = inside; \
+            } \
+            if(node->right >= 0 && (inside || hi[node->dim] >= a)) { \
+                stack[n_stack].node = node->right; \
+                stack[n_stack++].inside = inside; \
+            } \
+        } \
+        return 0; \
+    } \
+    ssize_t A##_box(N *tree, T *lo, T *hi, bool mark, size_t *pts, size_t len) { \
+        assert(tree); \
+        assert(lo); \
+        assert(hi); \
+        ssize_t used = 0; \
+        int result = A##_static_box(tree, lo, hi, pts, len, &used, mark ? &tree->visit : 0, 0, 0); \
+        return result < 0 ? result : used; \
+    } \
+    /* each may be 0 to just count; hits are reported with a distance of 0 */ \
+    ssize_t A##_box_each(N *tree, T *lo, T *hi, bool mark, KDTreeEach each, void *ctx) { \
+        assert(tree); \
+        assert(lo); \
+        assert(hi); \
+        ssize_t used = 0; \
+        A##_static_box(tree, lo, hi, 0, SIZE_MAX, &used, mark ? &tree->visit : 0, each, ctx); \
+        return used; \
+    }
+
+#define KDTREE_IMPLEMENT_STATIC_LOCATE(N, A, T, D) \
+    /* descend without backtracking, returns the last node visited */ \
+    static inline ssize_t A##_static_locate(N *tree, T *pt) { \
+        ssize_t root = tree->root; \
+        ssize_t last = root; \
+        while(root >= 0) { \
+            KDTreeNode *node = &tree->buckets[root]; \
+            last = root; \
+            if(node->leaf) break; \
+            T a = A##_static_point(tree, root)[node->dim]; \
+            root = pt[node->dim] <= a ? node->left : node->right; \
+        } \
+        return last; \
+    }
+
+#define KDTREE_IMPLEMENT_STATIC_BATCH_ORDER(N, A, T, D) \
+    /* sort queries by the in-order position they descend to, so that consecutive \
+     * queries walk mostly the same nodes */ \
+    static inline KDTreeBatchKey *A##_static_batch_order(N *tree, T *pts, size_t n, size_t stride) { \
+        KDTreeBatchKey *order = malloc(sizeof(*order) * n); \
+        if(!order) return 0; \
+        for(size_t i = 0; i < n; i++) { \
+            ssize_t key = A##_static_locate(tree, &pts[i * stride]); \
+            order[i] = (KDTreeBatchKey){ .key = (size_t)key, .i = i }; \
+        } \
+        qsort(order, n, sizeof(*order), kdtree_static_batch_cmp); \
+        return order; \
+    }
+
+#define KDTREE_IMPLEMENT_NEAREST_BATCH(N, A, T, D) \
+    ssize_t A##_nearest_batch(N *tree, T *pts, size_t n, size_t stride, ssize_t *idx_out, double *dist_out) { \
+        assert(tree); \
+        assert(pts || !n); \
+        assert(idx_out || !n); \
+        if(!stride) stride = KDTREE_DIM(tree, D); \
+        KDTreeBatchKey *order = A##_static_batch_order(tree, pts, n, stride); \
+        if(n && !order) return -1; \
+        ssize_t best = -1; \
+        for(size_t j = 0; j < n; j++) { \
+            size_t i = order[j].i; \
+            T *pt = &pts[i * stride]; \
+            /* the previous answer is nearby, use it as the initial bound */ \
+            N##Acc best_dist = A##_metric_far(); \
+            if(best >= 0) { \
+                best_dist = A##_static_distance(tree, KDTREE_DIM(tree, D), pt, A##_static_point(tree, best)); \
+            } \
+            A##_static_nearest(tree, tree->root, pt, &best, &best_dist, 0); \
+            idx_out[i] = best >= 0 ? (ssize_t)tree->buckets[best].index : -1; \
+            if(dist_out) dist_out[i] = best >= 0 ? (double)best_dist : INFINITY; \
+        } \
+        free(order); \
+        return 0; \
+    }
+
+#define KDTREE_IMPLEMENT_NEAREST_BATCH_MT(N, A, T, D) \
+    typedef struct N##BatchTask { \
+        N *tree; \
+        T *pts; \
+        size_t n; \
+        size_t stride; \
+        ssize_t *idx_out; \
+        double *dist_out; \
+        ssize_t result; \
+    } N##BatchTask; \
+    static void *A##_static_nearest_batch_task(void *arg) { \
+        N##BatchTask *task = arg; \
+        task->result = A##_nearest_batch(task->tree, task->pts, task->n, task->stride, task->idx_out, task->dist_out); \
+        return 0; \
+    } \
+    /* every thread gets a contiguous chunk of queries and its own output slots; \
+     * the tree is only ever read */ \
+    ssize_t A##_nearest_batch_mt(N *tree, T *pts, size_t n, size_t stride, ssize_t *idx_out, double *dist_out, size_t n_threads) { \
+        assert(tree); \
+        if(!stride) stride = KDTREE_DIM(tree, D); \
+        if(n_threads > n) n_threads = n; \
+        if(n_threads <= 1) return A##_nearest_batch(tree, pts, n, stride, idx_out, dist_out); \
+        N##BatchTask *tasks = malloc(sizeof(*tasks) * n_threads); \
+        pthread_t *threads = malloc(sizeof(*threads) * n_threads); \
+        if(!tasks || !threads) { \
+            free(tasks); \
+            free(threads); \
+            return -1; \
+        } \
+        size_t spawned = 0; \
+        for(size_t t = 0; t < n_threads; t++) { \
+            size_t i0 = n * t / n_threads; \
+            size_t iE = n * (t + 1) / n_threads; \
+            tasks[t] = (N##BatchTask){ \
+                .tree = tree, \
+                .pts = &pts[i0 * stride], \
+                .n = iE - i0, \
+                .stride = stride, \
+                .idx_out = &idx_out[i0], \
+                .dist_out = dist_out ? &dist_out[i0] : 0, \
+            }; \
+        } \
+        /* the calling thread works on the first chunk itself */ \
+        for(size_t t = 1; t < n_threads; t++) { \
+            if(pthread_create(&threads[t], 0, A##_static_nearest_batch_task, &tasks[t])) break; \
+            spawned = t; \
+        } \
+        A##_static_nearest_batch_task(&tasks[0]); \
+        for(size_t t = 1; t <= spawned; t++) { \
+            pthread_join(threads[t], 0); \
+        } \
+        /* chunks that could not get a thread */ \
+        for(size_t t = spawned + 1; t < n_threads; t++) { \
+            A##_static_nearest_batch_task(&tasks[t]); \
+        } \
+        ssize_t result = 0; \
+        for(size_t t = 0; t < n_threads; t++) { \
+            if(tasks[t].result < 0) result = tasks[t].result; \
+        } \
+        free(tasks); \
+        free(threads); \
+        return result; \
+    }
+
+#define KDTREE_IMPLEMENT_RANGE_BATCH(N, A, T, D) \
+    /* results of query i are written to idx_out[i * len ..] (and dist_out), \
+     * counts[i] is the number of hits or -1 if there were more than len */ \
+    ssize_t A##_range_batch(N *tree, T *pts, size_t n, size_t stride, double squared_dist, size_t *idx_out, double *dist_out, size_t len, ssize_t *counts) { \
+        assert(tree); \
+        assert(pts || !n); \
+        assert(counts || !n); \
+        if(!stride) stride = KDTREE_DIM(tree, D); \
+        KDTreeBatchKey *order = A##_static_batch_order(tree, pts, n, stride); \
+        if(n && !order) return -1; \
+        N##Acc range_dist = A##_metric_radius(squared_dist); \
+        for(size_t j = 0; j < n; j++) { \
+            size_t i = order[j].i; \
+            ssize_t used = 0; \
+            size_t *pts_i = idx_out ? &idx_out[i * len] : 0; \
+            double *dists_i = dist_out ? &dist_out[i * len] : 0; \
+            int result = A##_static_range(tree, tree->root, &pts[i * stride], pts_i, dists_i, len, &used, range_dist, 0, 0, 0); \
+            counts[i] = result < 0 ? result : used; \
+        } \
+        free(order); \
+        return 0; \
+    }
+
+#define KDTREE_IMPLEMENT_STATIC_COLLECT(N, A, T, D) \
+    /* count (and write out) the indices in a subtree, optionally without the removed ones */ \
+    static size_t A##_static_collect(N *tree, ssize_t root, size_t *out, bool live) { \
+        if(root < 0) return 0; \
+        ssize_t stack[tree->height + 2]; \
+        size_t n_stack = 0; \
+        size_t n = 0; \
+        stack[n_stack++] = root; \
+        while(n_stack) { \
+            ssize_t i = stack[--n_stack]; \
+            KDTreeNode *node = &tree->buckets[i]; \
+            size_t count = node->leaf ? node->leaf : 1; \
+            for(size_t j = i; j < i + count; j++) { \
+                KDTreeNode *p = &tree->buckets[j]; \
+                if(live && p->dead) continue; \
+                if(out) out[n] = p->index; \
+                n++; \
+            } \
+            if(node->leaf) continue; \
+            assert(n_stack + 2 <= tree->height + 2); \
+            if(node->left >= 0) stack[n_stack++] = node->left; \
+            if(node->right >= 0) stack[n_stack++] = node->right; \
+        } \
+        return n; \
+    }
+
+#define KDTREE_IMPLEMENT_STATIC_REBUILD(N, A, T, D) \
+    /* build the live points of a subtree (plus extra, if >= 0) into a fresh block \
+     * at the end of the buckets; the old slots stay behind unreachable */ \
+    static int A##_static_rebuild(N *tree, ssize_t *root, size_t i_dim, ssize_t extra, size_t *height) { \
+        size_t total = A##_static_collect(tree, *root, 0, false); \
+        size_t *points = kdtree_alloc(tree->allocator, sizeof(*points) * (total + 1)); \
+        if(!points) return -1; \
+        if(kdtree_node_reserve(tree->allocator, &tree->buckets, &tree->cap_buckets, tree->n_buckets + total + 1)) { \
+            kdtree_free(tree->allocator, points, sizeof(*points) * (total + 1)); \
+            return -1; \
+        } \
+        size_t m = A##_static_collect(tree, *root, points, true); \
+        tree->n_dead -= total - m; \
+        if(extra >= 0) points[m++] = (size_t)extra; \
+        size_t i0 = tree->n_buckets; \
+        for(size_t i = 0; i < m; i++) { \
+            tree->buckets[tree->n_buckets++] = (KDTreeNode){ .index = points[i] }; \
+        } \
+        tree->generation++; \
+        kdtree_free(tree->allocator, points, sizeof(*points) * (total + 1)); \
+        *height = 0; \
+        *root = m ? A##_static_create(tree, i0, i0 + m, i_dim, 1, height) : -1; \
+        return A##_static_copy(tree, i0, i0 + m); \
+    } \
+    /* start over with only the live points once removed and unreachable buckets dominate */ \
+    static int A##_static_compact(N *tree) { \
+        size_t garbage = tree->n_buckets - tree->n_live; \
+        if(garbage <= tree->n_live) return 0; \
+        size_t n_live = tree->n_live; \
+        size_t *points = kdtree_alloc(tree->allocator, sizeof(*points) * (n_live + 1)); \
+        if(!points) return -1; \
+        size_t m = A##_static_collect(tree, tree->root, points, true); \
+        assert(m == tree->n_live); \
+        tree->n_buckets = 0; \
+        tree->generation++; \
+        for(size_t i = 0; i < m; i++) { \
+            tree->buckets[tree->n_buckets++] = (KDTreeNode){ .index = points[i] }; \
+        } \
+        kdtree_free(tree->allocator, points, sizeof(*points) * (n_live + 1)); \
+        tree->n_dead = 0; \
+        tree->root = A##_static_create(tree, 0, m, 0, 1, &tree->height); \
+        if(A##_static_copy(tree, 0, m)) return -1; \
+        return A##_static_bounds(tree, tree->root); \
+    } \
+    /* marks are by bucket, which insert and remove move around */ \
+    static int A##_static_visit_reset(N *tree) { \
+        if(kdtree_visit_resize(&tree->visit, tree->n_buckets)) return -1; \
+        kdtree_visit_clear(&tree->visit); \
+        tree->visit.generation = tree->generation; \
+        return 0; \
+    }
+
+#define KDTREE_IMPLEMENT_INSERT(N, A, T, D) \
+    /* ref and len are the (possibly reallocated) array the tree was created from, \
+     * index is where the new point starts */ \
+    int A##_insert(N *tree, T *ref, size_t len, size_t index) { \
+        assert(tree); \
+        assert(ref); \
+        assert(tree->dim); \
+        assert(index + KDTREE_DIM(tree, D) <= len); \
+        if(tree->map) return -1; \
+        tree->ref = ref; \
+        tree->len = len; \
+        T *pt = &ref[index]; \
+        /* descend to where the point belongs, remembering the path */ \
+        size_t path_len = tree->height + 1; \
+        ssize_t *path = kdtree_alloc(tree->allocator, sizeof(*path) * path_len); \
+        if(!path) return -1; \
+        size_t depth = 0; \
+        size_t i_dim = 0; \
+        ssize_t root = tree->root; \
+        while(root >= 0) { \
+            KDTreeNode *node = &tree->buckets[root]; \
+            if(node->leaf) break; \
+            path[depth++] = root; \
+            T a = A##_static_get_at(tree->ref, node->index + node->dim, tree->len); \
+            root = pt[node->dim] <= a ? node->left : node->right; \
+            i_dim = node->dim + 1 < KDTREE_DIM(tree, D) ? node->dim + 1 : 0; \
+        } \
+        size_t height = 1; \
+        if(root >= 0) { \
+            /* leaves can't grow in place */ \
+            if(A##_static_rebuild(tree, &root, i_dim, (ssize_t)index, &height)) { \
+                kdtree_free(tree->allocator, path, sizeof(*path) * path_len); \
+                return -1; \
+            } \
+        } else { \
+            if(kdtree_node_reserve(tree->allocator, &tree->buckets, &tree->cap_buckets, tree->n_buckets + 1)) { \
+                kdtree_free(tree->allocator, path, sizeof(*path) * path_len); \
+                return -1; \
+            } \
+            tree->buckets[tree->n_buckets++] = (KDTreeNode){ .index = index }; \
+            root = tree->n_buckets - 1; \
+            tree->buckets[root].left = -1; \
+            tree->buckets[root].right = -1; \
+            if(A##_static_copy(tree, root, root + 1)) { \
+                kdtree_free(tree->allocator, path, sizeof(*path) * path_len); \
+                return -1; \
+            } \
+        } \
+        tree->n_live++; \
+        for(;;) { \
+            /* hook the (new) subtree in */ \
+            if(!depth) { \
+                tree->root = root; \
+            } else { \
+                KDTreeNode *parent = &tree->buckets[path[depth - 1]]; \
+                T a = A##_static_get_at(tree->ref, parent->index + parent->dim, tree->len); \
+                if(pt[parent->dim] <= a) parent->left = root; \
+                else parent->right = root; \
+            } \
+            if(depth + height > tree->height) tree->height = depth + height; \
+            double limit = log((double)(tree->n_live + tree->n_dead)) / log(1.0 / KDTREE_ALPHA) + 1; \
+            if(!depth || (double)(depth + height) <= limit) break; \
+            /* too deep, look for the scapegoat on the way up */ \
+            size_t size = A##_static_collect(tree, root, 0, false); \
+            while(depth) { \
+                KDTreeNode *parent = &tree->buckets[path[depth - 1]]; \
+                ssize_t sibling = parent->left == root ? parent->right : parent->left; \
+                size_t size_parent = size + 1 + A##_static_collect(tree, sibling, 0, false); \
+                root = path[--depth]; \
+                if((double)size > KDTREE_ALPHA * (double)size_parent) break; \
+                size = size_parent; \
+            } \
+            KDTreeNode *scapegoat = &tree->buckets[root]; \
+            if(A##_static_rebuild(tree, &root, scapegoat->dim, -1, &height)) { \
+                kdtree_free(tree->allocator, path, sizeof(*path) * path_len); \
+                return -1; \
+            } \
+            /* hook it in, no need to check again */ \
+            if(!depth) { \
+                tree->root = root; \
+            } else { \
+                KDTreeNode *parent = &tree->buckets[path[depth - 1]]; \
+                T a = A##_static_get_at(tree->ref, parent->index + parent->dim, tree->len); \
+                if(pt[parent->dim] <= a) parent->left = root; \
+                else parent->right = root; \
+            } \
+            if(depth + height > tree->height) tree->height = depth + height; \
+            break; \
+        } \
+        /* new subtree from scratch, the ones above it just grew by pt */ \
+        int bounds = A##_static_bounds(tree, root); \
+        for(size_t i = 0; !bounds && i < depth; i++) { \
+            A##_static_bounds_update(tree, path[i], pt, 1); \
+        } \
+        kdtree_free(tree->allocator, path, sizeof(*path) * path_len); \
+        if(bounds) return -1; \
+        if(A##_static_compact(tree)) return -1; \
+        return A##_static_visit_reset(tree); \
+    }
+
+#define KDTREE_IMPLEMENT_REMOVE(N, A, T, D) \
+    /* the point is only flagged; it gets dropped by the next rebuild it is part of */ \
+    int A##_remove(N *tree, size_t index) { \
+        assert(tree); \
+        if(tree->map || tree->root < 0) return -1; \
+        if(index > tree->len || tree->len - index < KDTREE_DIM(tree, D)) return -1; \
+        T *pt = &tree->ref[index]; \
+        N##StackItem stack[tree->height + 2]; \
+        size_t depths[tree->height + 2]; \
+        ssize_t path[tree->height + 1]; \
+        size_t n_stack = 0; \
+        size_t depth = 0; \
+        ssize_t found = -1; \
+        depths[n_stack] = 0; \
+        stack[n_stack++] = (N##StackItem){ .node = tree->root }; \
+        while(n_stack && found < 0) { \
+            N##StackItem item = stack[--n_stack]; \
+            KDTreeNode *node = &tree->buckets[item.node]; \
+            /* the ancestors of whatever gets found */ \
+            depth = depths[n_stack]; \
+            path[depth] = item.node; \
+            if(node->leaf) { \
+                for(size_t j = item.node; j < item.node + node->leaf; j++) { \
+                    if(tree->buckets[j].index == index && !tree->buckets[j].dead) found = j; \
+                } \
+                continue; \
+            } \
+            if(node->index == index && !node->dead) { \
+                found = item.node; \
+                break; \
+            } \
+            /* equal values may have ended up on either side */ \
+            T a = A##_static_get_at(tree->ref, node->index + node->dim, tree->len); \
+            assert(n_stack + 2 <= tree->height + 2); \
+            if(pt[node->dim] <= a && node->left >= 0) { \
+                depths[n_stack] = depth + 1; \
+                stack[n_stack++] = (N##StackItem){ .node = node->left }; \
+            } \
+            if(pt[node->dim] >= a && node->right >= 0) { \
+                depths[n_stack] = depth + 1; \
+                stack[n_stack++] = (N##StackItem){ .node = node->right }; \
+            } \
+        } \
+        if(found < 0) return -1; \
+        for(size_t i = 0; i <= depth; i++) { \
+            A##_static_bounds_update(tree, path[i], 0, -1); \
+        } \
+        tree->buckets[found].dead = true; \
+        tree->n_live--; \
+        tree->n_dead++; \
+        if(A##_static_compact(tree)) return -1; \
+        return A##_static_visit_reset(tree); \
+    }
+
+#define KDTREE_IMPLEMENT_CLEAR_MARK(N, A, T, D); \
+    void A##_mark_clear(N *tree) { \
+        assert(tree); \
+        kdtree_visit_clear(&tree->visit); \
+    } \
+    int A##_visit_create(N *tree, KDTreeVisit *visit) { \
+        assert(tree); \
+        if(kdtree_visit_init(visit, tree->n_buckets)) return -1; \
+        visit->generation = tree->generation; \
+        return 0; \
+    }
+
+#define KDTREE_IMPLEMENT_FREE(N, A, T, D) \
+    void A##_free(N *tree ) { \
+        assert(tree); \
+        if(tree->map) { \
+            munmap(tree->map, tree->map_len); \
+        } else { \
+            kdtree_free(tree->allocator, tree->coords, sizeof(T) * KDTREE_DIM(tree, D) * tree->coords_cap); \
+            kdtree_free(tree->allocator, tree->boxes, sizeof(T) * 2 * KDTREE_DIM(tree, D) * tree->bounds_cap); \
+            kdtree_free(tree->allocator, tree->sizes, sizeof(size_t) * tree->bounds_cap); \
+            kdtree_free(tree->allocator, tree->buckets, sizeof(KDTreeNode) * tree->cap_buckets); \
+        } \
+        kdtree_visit_free(&tree->visit); \
+        memset(tree, 0, sizeof(*tree)); \
+    }
+
+#define KDTREE_IMPLEMENT_SAVE(N, A, T, D) \
+    int A##_save(N *tree, const char *path) { \
+        assert(tree); \
+        assert(path); \
+        KDTreeFileHeader header = { \
+            .magic = KDTREE_FILE_MAGIC, \
+            .version = KDTREE_FILE_VERSION, \
+            .node_size = sizeof(KDTreeNode), \
+            .type_size = sizeof(T), \
+            .flags = (tree->coords ? KDTREE_FILE_COORDS : 0) | (tree->boxes ? KDTREE_FILE_BOUNDS : 0), \
+            .dim = tree->dim, \
+            .stride = tree->stride, \
+            .len = tree->len, \
+            .n_buckets = tree->n_buckets, \
+            .height = tree->height, \
+            .leaf_size = tree->leaf_size, \
+            .n_live = tree->n_live, \
+            .n_dead = tree->n_dead, \
+            .root = tree->root, \
+            .split = tree->split, \
+        }; \
+        FILE *file = fopen(path, "wb"); \
+        if(!file) return -1; \
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1; \
+        ok = ok && fwrite(tree->buckets, sizeof(KDTreeNode), tree->n_buckets, file) == tree->n_buckets; \
+        if(tree->boxes) { \
+            ok = ok && fwrite(tree->sizes, sizeof(size_t), tree->n_buckets, file) == tree->n_buckets; \
+        } \
+        if(tree->coords) { \
+            size_t n = tree->n_buckets * KDTREE_DIM(tree, D); \
+            ok = ok && fwrite(tree->coords, sizeof(T), n, file) == n; \
+        } \
+        if(tree->boxes) { \
+            size_t n = tree->n_buckets * 2 * KDTREE_DIM(tree, D); \
+            ok = ok && fwrite(tree->boxes, sizeof(T), n, file) == n; \
+        } \
+        if(fclose(file)) ok = false; \
+        return ok ? 0 : -1; \
+    }
+
+#define KDTREE_IMPLEMENT_LOAD_MMAP(N, A, T, D) \
+    /* walk the mapped nodes once before trusting them: children and leaf runs \
+     * within the buckets, every bucket reached at most once (so no cycles), \
+     * split dimensions below dim and points within ref. The height comes from \
+     * the walk rather than the file, as it sizes the traversal stacks. */ \
+    static int A##_static_check(N *tree) { \
+        tree->height = 0; \
+        if(tree->root < 0) return 0; \
+        size_t dim = KDTREE_DIM(tree, D); \
+        struct { ssize_t node; size_t depth; } *stack = kdtree_alloc(tree->allocator, sizeof(*stack) * tree->n_buckets); \
+        if(!stack) return -1; \
+        size_t n_stack = 0; \
+        int result = 0; \
+        kdtree_visit_mark(&tree->visit, tree->root); \
+        stack[n_stack].node = tree->root; \
+        stack[n_stack++].depth = 1; \
+        while(n_stack && !result) { \
+            n_stack--; \
+            ssize_t root = stack[n_stack].node; \
+            size_t depth = stack[n_stack].depth; \
+            KDTreeNode *node = &tree->buckets[root]; \
+            if(depth > tree->height) tree->height = depth; \
+            size_t n = node->leaf ? node->leaf : 1; \
+            if(n > tree->n_buckets - root || (!node->leaf && node->dim >= dim)) { \
+                result = -1; \
+                break; \
+            } \
+            for(size_t i = root; i < root + n; i++) { \
+                if(i > (size_t)root && kdtree_visit_marked(&tree->visit, i)) result = -1; \
+                kdtree_visit_mark(&tree->visit, i); \
+                size_t index = tree->buckets[i].index; \
+                if(!tree->coords && (index > tree->len || tree->len - index < dim)) result = -1; \
+            } \
+            if(node->leaf) continue; \
+            ssize_t child[2] = { node->left, node->right }; \
+            for(size_t c = 0; c < 2 && !result; c++) { \
+                if(child[c] == -1) continue; \
+                if(child[c] < -1 || child[c] >= (ssize_t)tree->n_buckets || kdtree_visit_marked(&tree->visit, child[c])) { \
+                    result = -1; \
+                    break; \
+                } \
+                kdtree_visit_mark(&tree->visit, child[c]); \
+                stack[n_stack].node = child[c]; \
+                stack[n_stack++].depth = depth + 1; \
+            } \
+        } \
+        kdtree_free(tree->allocator, stack, sizeof(*stack) * tree->n_buckets); \
+        kdtree_visit_clear(&tree->visit); \
+        return result; \
+    } \
+    /* the tree is queried straight from the mapped pages, which stay read only; \
+     * ref (of length len) is only needed if the file has no copy of the points */ \
+    int A##_load_mmap(N *tree, const char *path, T *ref, size_t len) { \
+        assert(tree); \
+        assert(path); \
+        int fd = open(path, O_RDONLY); \
+        if(fd < 0) return -1; \
+        struct stat st; \
+        if(fstat(fd, &st) || (size_t)st.st_size < sizeof(KDTreeFileHeader)) { \
+            close(fd); \
+            return -1; \
+        } \
+        size_t map_len = (size_t)st.st_size; \
+        char *map = mmap(0, map_len, PROT_READ, MAP_SHARED, fd, 0); \
+        close(fd); \
+        if(map == MAP_FAILED) return -1; \
+        KDTreeFileHeader *header = (KDTreeFileHeader *)map; \
+        bool coords = header->flags & KDTREE_FILE_COORDS; \
+        bool bounds = header->flags & KDTREE_FILE_BOUNDS; \
+        /* keep every product below map_len, so the sums below can't wrap */ \
+        size_t n_max = header->n_buckets ? header->n_buckets : 1; \
+        if(header->n_buckets > map_len / sizeof(KDTreeNode) \
+                || ((coords || bounds) && header->dim > map_len / sizeof(T) / n_max)) { \
+            munmap(map, map_len); \
+            return -1; \
+        } \
+        size_t at_sizes = sizeof(*header) + header->n_buckets * sizeof(KDTreeNode); \
+        size_t at_coords = at_sizes + (bounds ? header->n_buckets * sizeof(size_t) : 0); \
+        size_t at_boxes = at_coords + (coords ? header->n_buckets * header->dim * sizeof(T) : 0); \
+        size_t expect = at_boxes + (bounds ? header->n_buckets * 2 * header->dim * sizeof(T) : 0); \
+        if(memcmp(header->magic, KDTREE_FILE_MAGIC, sizeof(header->magic)) \
+                || header->version != KDTREE_FILE_VERSION \
+                || header->node_size != sizeof(KDTreeNode) \
+                || header->type_size != sizeof(T) \
+                || !header->dim || (D && header->dim != D) \
+                || expect != map_len \
+                || header->root < -1 || (header->root >= 0 && (uint64_t)header->root >= header->n_buckets) \
+                || (!coords && (!ref || len < header->len))) { \
+            munmap(map, map_len); \
+            return -1; \
+        } \
+        KDTreeAllocator *allocator = tree->allocator; \
+        memset(tree, 0, sizeof(*tree)); \
+        tree->allocator = allocator; \
+        tree->visit.allocator = allocator; \
+        tree->map = map; \
+        tree->map_len = map_len; \
+        tree->buckets = (KDTreeNode *)(map + sizeof(*header)); \
+        tree->n_buckets = header->n_buckets; \
+        tree->coords = coords ? (T *)(map + at_coords) : 0; \
+        tree->copy = coords; \
+        tree->sizes = bounds ? (size_t *)(map + at_sizes) : 0; \
+        tree->boxes = bounds ? (T *)(map + at_boxes) : 0; \
+        tree->bounds = bounds; \
+        tree->ref = ref; \
+        tree->len = ref ? len : header->len; \
+        tree->dim = header->dim; \
+        tree->stride = header->stride; \
+        tree->leaf_size = header->leaf_size; \
+        tree->split = (KDTreeSplit)header->split; \
+        tree->root = header->root; \
+        tree->n_live = header->n_live; \
+        tree->n_dead = header->n_dead; \
+        if(kdtree_visit_init(&tree->visit, tree->n_buckets) || A##_static_check(tree)) { \
+            A##_free(tree); \
+            return -1; \
+        } \
+        return 0; \
+    }
+
+
+/* sliding window
+ *
+ * KDTREE_INCLUDE_WINDOW(N, A, T);
+ * KDTREE_IMPLEMENT_WINDOW(N, A, T);
+ *
+ * Needs KDTREE_INCLUDE / KDTREE_IMPLEMENT(N, A, T) first. Keeps a ring of up to
+ * n_slices trees, one per A##_window_push. Pushing into a full ring drops the
+ * oldest slice. Queries run over every live slice and report, next to the index
+ * into that slice's ref, the slice's sequence number (0 for the first push).
+ * The ref of a slice has to stay valid until it is expired.
+ */
+
+#define KDTREE_INCLUDE_WINDOW(N, A, T) \
+    typedef struct N##Window { \
+        N *slices;      /* ring of trees */ \
+        size_t n_slices; /* capacity of the ring */ \
+        size_t head;    /* slot of the oldest slice */ \
+        size_t count;   /* live slices */ \
+        size_t first;   /* sequence number of the oldest slice */ \
+        size_t dim; \
+        size_t leaf_size; /* passed to each slice */ \
+        double *weights; /* passed to each slice */ \
+        double *period; /* passed to each slice */ \
+    } N##Window; \
+    \
+    int A##_window_init(N##Window *window, size_t n_slices, size_t dim); \
+    int A##_window_push(N##Window *window, T *ref, size_t len, size_t offset, size_t stride); \
+    void A##_window_expire(N##Window *window); \
+    ssize_t A##_window_nearest(N##Window *window, T *pt, double *squared_dist, size_t *slice); \
+    ssize_t A##_window_range(N##Window *window, T *pt, double squared_dist, size_t *pts, size_t *slices, size_t len); \
+    void A##_window_free(N##Window *window); \
+
+#define KDTREE_IMPLEMENT_WINDOW(N, A, T) \
+    int A##_window_init(N##Window *window, size_t n_slices, size_t dim) { \
+        assert(window); \
+        assert(n_slices); \
+        assert(dim); \
+        size_t leaf_size = window->leaf_size; \
+        double *weights = window->weights; \
+        double *period = window->period; \
+        memset(window, 0, sizeof(*window)); \
+        window->slices = calloc(n_slices, sizeof(*window->slices)); \
+        if(!window->slices) return -1; \
+        window->n_slices = n_slices; \
+        window->dim = dim; \
+        window->leaf_size = leaf_size; \
+        window->weights = weights; \
+        window->period = period; \
+        return 0; \
+    } \
+    void A##_window_expire(N##Window *window) { \
+        assert(window); \
+        if(!window->count) return; \
+        A##_free(&window->slices[window->head]); \
+        if(++window->head >= window->n_slices) window->head = 0; \
+        window->count--; \
+        window->first++; \
+    } \
+    int A##_window_push(N##Window *window, T *ref, size_t len, size_t offset, size_t stride) { \
+        assert(window); \
+        assert(window->slices); \
+        if(window->count == window->n_slices) A##_window_expire(window); \
+        N *tree = &window->slices[(window->head + window->count) % window->n_slices]; \
+        memset(tree, 0, sizeof(*tree)); \
+        tree->leaf_size = window->leaf_size; \
+        tree->weights = window->weights; \
+        tree->period = window->period; \
+        if(A##_create(tree, ref, len, window->dim, offset, stride)) { \
+            A##_free(tree); \
+            return -1; \
+        } \
+        window->count++; \
+        return 0; \
+    } \
+    ssize_t A##_window_nearest(N##Window *window, T *pt, double *squared_dist, size_t *slice) { \
+        assert(window); \
+        assert(pt); \
+        ssize_t best = -1; \
+        double best_dist = INFINITY; \
+        for(size_t i = 0; i < window->count; i++) { \
+            N *tree = &window->slices[(window->head + i) % window->n_slices]; \
+            double dist; \
+            ssize_t result = A##_nearest(tree, pt, &dist, false); \
+            if(result < 0 || dist >= best_dist) continue; \
+            best = result; \
+            best_dist = dist; \
+            if(slice) *slice = window->first + i; \
+        } \
+        if(squared_dist) *squared_dist = best_dist; \
+        return best; \
+    } \
+    ssize_t A##_window_range(N##Window *window, T *pt, double squared_dist, size_t *pts, size_t *slices, size_t len) { \
+        assert(window); \
+        assert(pt); \
+        size_t used = 0; \
+        for(size_t i = 0; i < window->count; i++) { \
+            N *tree = &window->slices[(window->head + i) % window->n_slices]; \
+            ssize_t result = A##_range(tree, pt, squared_dist, false, pts ? pts + used : 0, len - used); \
+            if(result < 0) return -1; \
+            if(slices) { \
+                for(size_t j = used; j < used + (size_t)result; j++) slices[j] = window->first + i; \
+            } \
+            used += result; \
+        } \
+        return used; \
+    } \
+    void A##_window_free(N##Window *window) { \
+        assert(window); \
+        while(window->count) A##_window_expire(window); \
+        free(window->slices); \
+        memset(window, 0, sizeof(*window)); \
+    }
+
+
+/* randomized kd-forest
+ *
+ * KDTREE_INCLUDE_FOREST(N, A, T);
+ * KDTREE_IMPLEMENT_FOREST(N, A, T);
+ *
+ * Needs KDTREE_INCLUDE / KDTREE_IMPLEMENT(N, A, T) first. Builds n_trees trees
+ * over the same ref, each splitting along a dimension drawn from the largest
+ * variances (KDTREE_SPLIT_RANDOM, seeded per tree). Queries descend all trees
+ * from one priority queue, closest splitting plane first, and stop after
+ * max_checks points have been looked at (0: exact). For dimensions where a
+ * single tree ends up checking most points.
+ */
+
+#define KDTREE_INCLUDE_FOREST(N, A, T) \
+    typedef struct N##Forest { \
+        N *trees; \
+        size_t n_trees; \
+        size_t leaf_size; /* passed to each tree */ \
+        double *weights; /* passed to each tree */ \
+        double *period; /* passed to each tree */ \
+        uint64_t seed; /* tree i gets seed + i */ \
+    } N##Forest; \
+    \
+    int A##_forest_create(N##Forest *forest, size_t n_trees, T *ref, size_t len, size_t dim, size_t offset, size_t stride); \
+    ssize_t A##_forest_nearest(N##Forest *forest, KDTreeQuery *query, T *pt, double *squared_dist, size_t max_checks); \
+    ssize_t A##_forest_knearest(N##Forest *forest, KDTreeQuery *query, T *pt, size_t k, size_t max_checks); \
+    void A##_forest_free(N##Forest *forest); \
+
+#define KDTREE_IMPLEMENT_FOREST(N, A, T) \
+    /* pending subtree of one of the trees */ \
+    typedef struct N##ForestItem { \
+        ssize_t node; \
+        N##Acc bound; \
+        size_t tree; \
+    } N##ForestItem; \
+    KDTREE_IMPLEMENT_STATIC_BIN(A##_forest_static_bin, N##ForestItem) \
+    int A##_forest_create(N##Forest *forest, size_t n_trees, T *ref, size_t len, size_t dim, size_t offset, size_t stride) { \
+        assert(forest); \
+        assert(n_trees); \
+        size_t leaf_size = forest->leaf_size; \
+        double *weights = forest->weights; \
+        double *period = forest->period; \
+        uint64_t seed = forest->seed; \
+        memset(forest, 0, sizeof(*forest)); \
+        forest->leaf_size = leaf_size; \
+        forest->weights = weights; \
+        forest->period = period; \
+        forest->seed = seed; \
+        forest->trees = calloc(n_trees, sizeof(*forest->trees)); \
+        if(!forest->trees) return -1; \
+        for(size_t i = 0; i < n_trees; i++) { \
+            N *tree = &forest->trees[i]; \
+            tree->leaf_size = leaf_size; \
+            tree->weights = weights; \
+            tree->period = period; \
+            tree->split = KDTREE_SPLIT_RANDOM; \
+            tree->seed = seed + i; \
+            forest->n_trees++; \
+            if(A##_create(tree, ref, len, dim, offset, stride)) { \
+                A##_forest_free(forest); \
+                return -1; \
+            } \
+        } \
+        return 0; \
+    } \
+    /* results go to query->idx / query->dist / query->len, the queue to its scratch */ \
+    ssize_t A##_forest_knearest(N##Forest *forest, KDTreeQuery *query, T *pt, size_t k, size_t max_checks) { \
+        assert(forest); \
+        assert(query); \
+        assert(pt); \
+        query->len = 0; \
+        if(!k) return 0; \
+        /* each descent checks at least one point and queues at most one \
+         * subtree per level */ \
+        size_t cap = forest->n_trees; \
+        size_t height = 0; \
+        size_t n_buckets = 0; \
+        for(size_t t = 0; t < forest->n_trees; t++) { \
+            if(forest->trees[t].height > height) height = forest->trees[t].height; \
+            n_buckets += forest->trees[t].n_buckets; \
+        } \
+        cap += max_checks && max_checks < n_buckets / (height + 1) ? max_checks * (height + 1) : n_buckets; \
+        if(kdtree_query_reserve(query, k)) return -1; \
+        /* the k best distances in ACC go after the queue */ \
+        N##ForestItem *heap = kdtree_query_reserve_scratch(query, sizeof(*heap) * cap + sizeof(N##Acc) * k); \
+        if(!heap) return -1; \
+        size_t *idx_out = query->idx; \
+        N##Acc *dist = (N##Acc *)(heap + cap); \
+        size_t n_heap = 0; \
+        size_t len = 0; \
+        size_t checks = 0; \
+        for(size_t t = 0; t < forest->n_trees; t++) { \
+            if(forest->trees[t].root < 0) continue; \
+            A##_forest_static_bin_push(heap, &n_heap, (N##ForestItem){ .node = forest->trees[t].root, .bound = 0, .tree = t }); \
+        } \
+        while(n_heap) { \
+            N##ForestItem item = A##_forest_static_bin_pop(heap, &n_heap); \
+            /* the rest is at least as far */ \
+            if(len == k && item.bound >= dist[0]) break; \
+            if(max_checks && checks >= max_checks) break; \
+            N *tree = &forest->trees[item.tree]; \
+            ssize_t root = item.node; \
+            while(root >= 0) { \
+                KDTreeNode *node = &tree->buckets[root]; \
+                size_t iE = root + (node->leaf ? node->leaf : 1); \
+                N##Acc d[KDTREE_LEAF_CHUNK]; \
+                for(size_t j0 = root; j0 < iE; j0 += KDTREE_LEAF_CHUNK) { \
+                    size_t n = iE - j0 < KDTREE_LEAF_CHUNK ? iE - j0 : KDTREE_LEAF_CHUNK; \
+                    A##_static_distance_leaf(tree, pt, j0, n, d); \
+                    checks += n; \
+                    for(size_t j = 0; j < n; j++) { \
+                        if(tree->buckets[j0 + j].dead || (len == k && d[j] >= dist[0])) continue; \
+                        /* other trees may have found it already */ \
+                        size_t index = tree->buckets[j0 + j].index; \
+                        size_t l = 0; \
+                        while(l < len && idx_out[l] != index) l++; \
+                        if(l < len) continue; \
+                        A##_static_heap_push(idx_out, dist, &len, k, index, d[j]); \
+                    } \
+                } \
+                if(node->leaf) break; \
+                T a = A##_static_point(tree, root)[node->dim]; \
+                T b = A##_static_get_at(pt, node->dim, tree->dim); \
+                double splitting_dist; \
+                N##Acc dx2 = A##_static_plane(tree, node->dim, a, b, &splitting_dist); \
+                ssize_t nearer_node = splitting_dist <= 0 ? node->left : node->right; \
+                ssize_t further_node = splitting_dist <= 0 ? node->right : node->left; \
+                if(further_node >= 0 && (len < k || dx2 < dist[0])) { \
+                    assert(n_heap < cap); \
+                    A##_forest_static_bin_push(heap, &n_heap, (N##ForestItem){ .node = further_node, .bound = dx2, .tree = item.tree }); \
+                } \
+                root = nearer_node; \
+            } \
+        } \
+        A##_static_heap_sort(idx_out, dist, len); \
+        for(size_t i = 0; i < len; i++) query->dist[i] = dist[i]; \
+        query->len = len; \
+        return (ssize_t)len; \
+    } \
+    ssize_t A##_forest_nearest(N##Forest *forest, KDTreeQuery *query, T *pt, double *squared_dist, size_t max_checks) { \
+        ssize_t found = A##_forest_knearest(forest, query, pt, 1, max_checks); \
+        if(squared_dist) *squared_dist = found > 0 ? query->dist[0] : INFINITY; \
+        return found > 0 ? (ssize_t)query->idx[0] : -1; \
+    } \
+    void A##_forest_free(N##Forest *forest) { \
+        assert(forest); \
+        for(size_t i = 0; i < forest->n_trees; i++) A##_free(&forest->trees[i]); \
+        free(forest->trees); \
+        memset(forest, 0, sizeof(*forest)); \
+    }
+
+
+/* compact variant
+ *
+ * KDTREE_INCLUDE_COMPACT(N, A, T);
+ * KDTREE_IMPLEMENT_COMPACT(N, A, T);
+ *
+ * Same functions as above (create, nearest, knearest, range, mark_clear, free),
+ * but the tree is balanced and stored implicitly in BFS order: the children of
+ * node i are 2i+1 and 2i+2. Each node keeps a 32-bit index plus its split
+ * dimension and split value, so pruning does not touch ref. Marks live in a
+ * separate bitset. Requires len < 2^32.
+ */
+
+static inline size_t kdtree_static_left_size(size_t m) {
+    if(m <= 1) return 0;
+    /* h = floor(log2(m)) */
+    size_t h = 0;
+    while(((size_t)2 << h) <= m) h++;
+    size_t half = (size_t)1 << (h - 1); /* capacity of the last level of the left subtree */
+    size_t last = m - (((size_t)1 << h) - 1); /* nodes on the last level */
+    return half - 1 + (last < half ? last : half);
+}
+
+#define KDTREE_INCLUDE_COMPACT(N, A, T) \
+    typedef double N##Acc; \
+    typedef struct N##Node { \
+        uint32_t index; \
+        uint16_t dim; /* split dimension */ \
+        T split;      /* split value, same as ref[index + dim] */ \
+    } N##Node; \
+    typedef struct N { \
+        N##Node *nodes; /* BFS order */ \
+        uint64_t *marks; \
+        T* ref; \
+        size_t count; /* count of nodes */ \
+        size_t len;   /* length of ref array */ \
+        size_t dim;   /* count of dimensions */ \
+        size_t stride; \
+    } N; \
+    \
+    int A##_create(N *tree , T *ref, size_t len, size_t dim, size_t offset, size_t stride); \
+    ssize_t A##_nearest(N *tree , T *pt, double *squared_dist, bool mark); \
+    ssize_t A##_knearest(N *tree, T *pt, size_t k, size_t *idx_out, double *dist_out); \
+    ssize_t A##_range(N *tree, T *pt, double squared_dist, bool mark, size_t *pts, size_t len); \
+    void A##_mark_clear(N *tree); \
+    void A##_free(N *tree ); \
+    KDTREE_INCLUDE_METRIC_FUNCS(N, A, KDTREE_METRIC_L2) \
+    static inline double *A##_static_period(N *tree) { (void)tree; return 0; } \
+
+
+#define KDTREE_IMPLEMENT_COMPACT(N, A, T) \
+    KDTREE_IMPLEMENT_STATIC_DISTANCE(N, A, T, 0); \
+    KDTREE_IMPLEMENT_STATIC_HEAP(A##_static_heap, N##Acc); \
+    KDTREE_IMPLEMENT_COMPACT_STATIC_SELECT(N, A, T); \
+    KDTREE_IMPLEMENT_COMPACT_STATIC_CREATE(N, A, T); \
+    KDTREE_IMPLEMENT_COMPACT_CREATE(N, A, T); \
+    KDTREE_IMPLEMENT_COMPACT_STATIC_MARK(N, A, T); \
+    KDTREE_IMPLEMENT_COMPACT_STATIC_NEAREST(N, A, T); \
+    KDTREE_IMPLEMENT_COMPACT_NEAREST(N, A, T); \
+    KDTREE_IMPLEMENT_COMPACT_STATIC_KNEAREST(N, A, T); \
+    KDTREE_IMPLEMENT_COMPACT_KNEAREST(N, A, T); \
+    KDTREE_IMPLEMENT_COMPACT_STATIC_RANGE(N, A, T); \
+    KDTREE_IMPLEMENT_COMPACT_RANGE(N, A, T); \
+    KDTREE_IMPLEMENT_COMPACT_CLEAR_MARK(N, A, T); \
+    KDTREE_IMPLEMENT_COMPACT_FREE(N, A, T); \
+
+#define KDTREE_IMPLEMENT_COMPACT_STATIC_SELECT(N, A, T) \
+    /* put the k-th smallest of perm[i0..iE) along i_dim at k */ \
+    static inline void A##_static_select(T *ref, uint32_t *perm, size_t i0, size_t iE, size_t k, size_t i_dim) { \
+        while(iE - i0 > 1) { \
+            /* median of three */ \
+            T x = ref[perm[i0] + i_dim]; \
+            T y = ref[perm[i0 + (iE - i0) / 2] + i_dim]; \
+            T z = ref[perm[iE - 1] + i_dim]; \
+            T pivot = x < y ? (y < z ? y : (x < z ? z : x)) : (x < z ? x : (y < z ? z : y)); \
+            /* [i0, lt) < pivot, [lt, gt) == pivot, [gt, iE) > pivot */ \
+            size_t lt = i0; \
+            size_t gt = iE; \
+            size_t i = i0; \
+            while(i < gt) { \
+                T v = ref[perm[i] + i_dim]; \
+                if(v < pivot) { \
+                    KDTREE_SWAP(perm[lt], perm[i]); \
+                    lt++; \
+                    i++; \
+                } else if(pivot < v) { \
+                    gt--; \
+                    KDTREE_SWAP(perm[i], perm[gt]); \
+                } else { \
+                    i++; \
+                } \
+            } \
+            if(k < lt) iE = lt; \
+            else if(k >= gt) i0 = gt; \
+            else return; \
+        } \
+    }
+
+#define KDTREE_IMPLEMENT_COMPACT_STATIC_CREATE(N, A, T) \
+    static void A##_static_create(N *tree, uint32_t *perm, size_t i0, size_t iE, size_t slot, size_t i_dim) { \
+        if(iE <= i0) return; \
+        assert(slot < tree->count); \
+        size_t m = i0 + kdtree_static_left_size(iE - i0); \
+        A##_static_select(tree->ref, perm, i0, iE, m, i_dim); \
+        tree->nodes[slot] = (N##Node){ \
+            .index = perm[m], \
+            .dim = (uint16_t)i_dim, \
+            .split = tree->ref[perm[m] + i_dim], \
+        }; \
+        if(++i_dim >= tree->dim) i_dim = 0; \
+        A##_static_create(tree, perm, i0, m, 2 * slot + 1, i_dim); \
+        A##_static_create(tree, perm, m + 1, iE, 2 * slot + 2, i_dim); \
+    }
+
+#define KDTREE_IMPLEMENT_COMPACT_CREATE(N, A, T) \
+    int A##_create(N *tree , T *ref, size_t len, size_t dim, size_t offset, size_t stride) { \
+        assert(dim); \
+        assert(tree); \
+        assert(ref); \
+        if(len > UINT32_MAX || dim > UINT16_MAX) return -1; \
+        tree->ref = ref; \
+        tree->dim = dim; \
+        if(!stride) stride = dim; \
+        tree->stride = stride; \
+        tree->len = len; \
+        tree->count = offset < len ? (len - offset + stride - 1) / stride : 0; \
+        uint32_t *perm = malloc(sizeof(*perm) * tree->count); \
+        tree->nodes = malloc(sizeof(*tree->nodes) * tree->count); \
+        tree->marks = calloc((tree->count + 63) / 64, sizeof(*tree->marks)); \
+        if(tree->count && (!perm || !tree->nodes || !tree->marks)) { \
+            free(perm); \
+            A##_free(tree); \
+            return -1; \
+        } \
+        for(size_t i = 0; i < tree->count; i++) { \
+            perm[i] = (uint32_t)(offset + i * stride); \
+        } \
+        A##_static_create(tree, perm, 0, tree->count, 0, 0); \
+        free(perm); \
+        return 0; \
+    }
+
+#define KDTREE_IMPLEMENT_COMPACT_STATIC_MARK(N, A, T) \
+    static inline bool A##_static_marked(N *tree, size_t i) { \
+        return tree->marks[i / 64] & ((uint64_t)1 << (i % 64)); \
+    } \
+    static inline void A##_static_mark(N *tree, size_t i) { \
+        tree->marks[i / 64] |= ((uint64_t)1 << (i % 64)); \
+    }
+
+#define KDTREE_IMPLEMENT_COMPACT_STATIC_NEAREST(N, A, T) \
+    static inline void A##_static_nearest(N* tree, size_t root, T* pt, ssize_t *best, double *best_dist, bool mark) { \
+        if(root >= tree->count) return; \
+        N##Node *node = &tree->nodes[root]; \
+        N##Acc current_distance = A##_static_distance(tree, tree->dim, pt, &(tree->ref[node->index])); \
+        if((!mark || !A##_static_marked(tree, root)) && (*best < 0 || current_distance < *best_dist)) { \
             *best = root; \
             *best_dist = current_distance; \
         } \
-        if(!current_distance || !*best_dist) { return; } \
-        /* Calculate the distance from the target point to the splitting dimension of the current node */ \
-        T a = A##_static_get_at(tree->ref, node->index + i_dim, tree->len); \
-        T b = A##_static_get_at(pt, i_dim, tree->dim); \
-        double splitting_dist = b - a; \
+        if(!*best_dist) { return; } \
+        double splitting_dist = pt[node->dim] - node->split; \
         double dx2 = splitting_dist * splitting_dist; \
-        /* Traverse the KDTree based on the splitting dimension and the distance to the target */ \
-        ssize_t nearer_node; \
-        ssize_t further_node; \
-        if (splitting_dist <= 0) { \
-            nearer_node = node->left; \
-            further_node = node->right; \
-        } else { \
-            nearer_node = node->right; \
-            further_node = node->left; \
+        size_t nearer_node = 2 * root + 1; \
+        size_t further_node = 2 * root + 2; \
+        if (splitting_dist > 0) { \
+            nearer_node = 2 * root + 2; \
+            further_node = 2 * root + 1; \
         } \
-        if(++i_dim >= tree->dim) i_dim = 0; \
-        /* Search the nearest point in the nearer subtree */ \
-        A##_static_nearest(tree, nearer_node, pt, i_dim, best, best_dist, mark); \
-        /* Search the nearest point in the further subtree if necessary */ \
+        A##_static_nearest(tree, nearer_node, pt, best, best_dist, mark); \
         if(dx2 >= *best_dist) { return; } \
-        A##_static_nearest(tree, further_node, pt, i_dim, best, best_dist, mark); \
+        A##_static_nearest(tree, further_node, pt, best, best_dist, mark); \
     }
 
-#define KDTREE_IMPLEMENT_NEAREST(N, A, T); \
+#define KDTREE_IMPLEMENT_COMPACT_NEAREST(N, A, T) \
     ssize_t A##_nearest(N *tree, T *pt, double *squared_dist, bool mark) { \
         assert(tree); \
         assert(pt); \
@@ -211,76 +2900,97 @@ typedef struct KDTreeNode {
         if(!squared_dist) squared_dist = &temp_dist; \
         *squared_dist = INFINITY; \
         ssize_t i = -1; \
-        A##_static_nearest(tree, tree->root, pt, 0, &i, squared_dist, mark); \
-        KDTreeNode *node = array_it(tree->buckets, i); \
-        ssize_t result = i >= 0 ? node->index : -1; \
-        node->mark |= (bool)mark; \
-        return result; \
+        A##_static_nearest(tree, 0, pt, &i, squared_dist, mark); \
+        if(i < 0) return -1; \
+        if(mark) A##_static_mark(tree, i); \
+        return tree->nodes[i].index; \
     }
 
-#define KDTREE_IMPLEMENT_STATIC_RANGE(N, A, T) \
-    static inline int A##_static_range(N* tree, ssize_t root, T *pt, size_t *pts, size_t len, ssize_t *i, size_t i_dim, double range_dist, bool mark) { \
-        if(root < 0) return 0; \
-        /* Get the current node from the KDTree */ \
-        KDTreeNode* node = array_it(tree->buckets, root); \
-        /*printf("node indx %zi\n", node->index);*/ \
-        T a = A##_static_get_at(tree->ref, node->index + i_dim, tree->len); \
-        /* Calculate the distance from the target point to the current node */ \
-        double current_distance = A##_static_distance(tree->dim, pt, &(tree->ref[node->index])); \
-        if(((mark && !node->mark) || !mark) && (current_distance < range_dist)) { \
+#define KDTREE_IMPLEMENT_COMPACT_STATIC_KNEAREST(N, A, T) \
+    static inline void A##_static_knearest(N* tree, size_t root, T* pt, size_t k, size_t *idx, double *dist, size_t *len) { \
+        if(root >= tree->count) return; \
+        N##Node *node = &tree->nodes[root]; \
+        N##Acc current_distance = A##_static_distance(tree, tree->dim, pt, &(tree->ref[node->index])); \
+        A##_static_heap_push(idx, dist, len, k, root, current_distance); \
+        if(*len == k && !dist[0]) { return; } \
+        double splitting_dist = pt[node->dim] - node->split; \
+        double dx2 = splitting_dist * splitting_dist; \
+        size_t nearer_node = 2 * root + 1; \
+        size_t further_node = 2 * root + 2; \
+        if (splitting_dist > 0) { \
+            nearer_node = 2 * root + 2; \
+            further_node = 2 * root + 1; \
+        } \
+        A##_static_knearest(tree, nearer_node, pt, k, idx, dist, len); \
+        if(*len == k && dx2 >= dist[0]) { return; } \
+        A##_static_knearest(tree, further_node, pt, k, idx, dist, len); \
+    }
+
+#define KDTREE_IMPLEMENT_COMPACT_KNEAREST(N, A, T) \
+    ssize_t A##_knearest(N *tree, T *pt, size_t k, size_t *idx_out, double *dist_out) { \
+        assert(tree); \
+        assert(pt); \
+        assert(idx_out); \
+        if(!k) return 0; \
+        double *dist = dist_out ? dist_out : malloc(sizeof(*dist) * k); \
+        if(!dist) return -1; \
+        size_t len = 0; \
+        A##_static_knearest(tree, 0, pt, k, idx_out, dist, &len); \
+        A##_static_heap_sort(idx_out, dist, len); \
+        for(size_t i = 0; i < len; i++) { \
+            idx_out[i] = tree->nodes[idx_out[i]].index; \
+        } \
+        if(!dist_out) free(dist); \
+        return (ssize_t)len; \
+    }
+
+#define KDTREE_IMPLEMENT_COMPACT_STATIC_RANGE(N, A, T) \
+    static inline int A##_static_range(N* tree, size_t root, T *pt, size_t *pts, size_t len, ssize_t *i, double range_dist, bool mark) { \
+        if(root >= tree->count) return 0; \
+        N##Node *node = &tree->nodes[root]; \
+        N##Acc current_distance = A##_static_distance(tree, tree->dim, pt, &(tree->ref[node->index])); \
+        if((!mark || !A##_static_marked(tree, root)) && (current_distance < range_dist)) { \
             if(*i >= len) { \
                 return -1; \
             } \
-            node->mark |= (bool)mark; \
+            if(mark) A##_static_mark(tree, root); \
             if(pts) pts[*i] = node->index; \
             (*i)++; \
-        } /* else { return 0; } */ \
-        /* Calculate the distance from the target point to the splitting dimension of the current node */ \
-        T b = A##_static_get_at(pt, i_dim, tree->dim); \
-        double splitting_dist = b - a; \
+        } \
+        double splitting_dist = pt[node->dim] - node->split; \
         double dx2 = splitting_dist * splitting_dist; \
-        /* Traverse the KDTree based on the splitting dimension and the distance to the target */ \
-        ssize_t nearer_node; \
-        ssize_t further_node; \
-        if (splitting_dist <= 0) { \
-            nearer_node = node->left; \
-            further_node = node->right; \
-        } else { \
-            nearer_node = node->right; \
-            further_node = node->left; \
+        size_t nearer_node = 2 * root + 1; \
+        size_t further_node = 2 * root + 2; \
+        if (splitting_dist > 0) { \
+            nearer_node = 2 * root + 2; \
+            further_node = 2 * root + 1; \
         } \
-        if(++i_dim >= tree->dim) i_dim = 0; \
-        /* Search the nearest point in the nearer subtree */ \
-        int result = A##_static_range(tree, nearer_node, pt, pts, len, i, i_dim, range_dist, mark); \
-        /* Search the nearest point in the further subtree if necessary */ \
+        int result = A##_static_range(tree, nearer_node, pt, pts, len, i, range_dist, mark); \
         if(dx2 >= range_dist || result < 0) { return result; } \
-        result = A##_static_range(tree, further_node, pt, pts, len, i, i_dim, range_dist, mark); \
+        result = A##_static_range(tree, further_node, pt, pts, len, i, range_dist, mark); \
         return result; \
     }
 
-#define KDTREE_IMPLEMENT_RANGE(N, A, T); \
+#define KDTREE_IMPLEMENT_COMPACT_RANGE(N, A, T) \
     ssize_t A##_range(N *tree, T *pt, double squared_dist, bool mark, size_t *pts, size_t len) { \
         assert(tree); \
         assert(pt); \
         ssize_t used = 0; \
-        ssize_t result = (ssize_t)A##_static_range(tree, tree->root, pt, pts, len, &used, 0, squared_dist, mark); \
+        ssize_t result = (ssize_t)A##_static_range(tree, 0, pt, pts, len, &used, squared_dist, mark); \
         return result < 0 ? result : used; \
     }
 
-#define KDTREE_IMPLEMENT_CLEAR_MARK(N, A, T); \
+#define KDTREE_IMPLEMENT_COMPACT_CLEAR_MARK(N, A, T) \
     void A##_mark_clear(N *tree) { \
         assert(tree); \
-        size_t len = array_len(tree->buckets); \
-        for(size_t i = 0; i < len; i++) { \
-            KDTreeNode *node = array_it(tree->buckets, i); \
-            node->mark = false; \
-        } \
+        if(tree->marks) memset(tree->marks, 0, sizeof(*tree->marks) * ((tree->count + 63) / 64)); \
     }
 
-#define KDTREE_IMPLEMENT_FREE(N, A, T) \
+#define KDTREE_IMPLEMENT_COMPACT_FREE(N, A, T) \
     void A##_free(N *tree ) { \
         assert(tree); \
-        array_free(tree->buckets); \
+        free(tree->nodes); \
+        free(tree->marks); \
         memset(tree, 0, sizeof(*tree)); \
     }
 